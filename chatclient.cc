@@ -8,14 +8,25 @@
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 #include <cstring>
 #include <iostream>
 #include <csignal>
+#include <map>
+#include <vector>
 
 using namespace std;
 
 const int MAX_LENGTH = 1024;
+const int MAX_MESSAGE = 65536; // longest line, sent in pieces when over MAX_LENGTH
+
+// pieces of a long line, the same layout as the server's: magic, u8 piece count, u8 piece index, reserved, u32 message id
+const char FRAG_MAGIC = (char)0xF3;
+const int FRAG_HEADER_LEN = 8;
+const int FRAG_PIECE_MAX = MAX_LENGTH - FRAG_HEADER_LEN;
+const int MAX_PARTIAL = 16; // long lines received in part at once, the oldest is given up beyond that
+const long long PARTIAL_MICROS = 2000000; // a long line still missing pieces after this is given up
 
 const char *NEW_CONNECT_MSG = "+OK New Connection!\r\n";
 const char *BYE_MSG = "+OK Bye!";
@@ -23,8 +34,20 @@ const char *DISCONN_MSG = "+OK Connected Closed!";
 
 int socket_fd;
 struct sockaddr_in server_addr;
+// pieces of one long line received so far
+struct Partial {
+    vector<string> pieces;
+    long long started; // monotonic micros
+};
+
+uint32_t next_id = 0;
+map<uint32_t, Partial> partial; // by message id
 
 void signal_handler(int signal);
+void send_line(const string &message);
+bool frag_header(const char *data, size_t len);
+bool reassemble(const char *data, size_t len, string &whole);
+long long now_micros();
 
 int main(int argc, char *argv[]) {
 
@@ -76,9 +99,14 @@ int main(int argc, char *argv[]) {
 
         // Check data from the server
         if (FD_ISSET(socket_fd, &read_fds)) {
-            char buffer[MAX_LENGTH];
-            ssize_t bytes_received = recvfrom(socket_fd, buffer, MAX_LENGTH - 1, 0, (struct sockaddr *)&src_addr, &src_len);
-            if (bytes_received > 0) {
+            char buffer[MAX_LENGTH + 1];
+            ssize_t bytes_received = recvfrom(socket_fd, buffer, MAX_LENGTH, 0, (struct sockaddr *)&src_addr, &src_len);
+            string whole;
+            if (bytes_received > 0 && frag_header(buffer, bytes_received)) {
+                if (reassemble(buffer, bytes_received, whole)) {
+                    cout << whole << endl;
+                }
+            } else if (bytes_received > 0) {
                 buffer[bytes_received] = '\0';
                 cout << buffer << endl;
             }
@@ -88,7 +116,11 @@ int main(int argc, char *argv[]) {
         if (FD_ISSET(STDIN_FILENO, &read_fds)) {
             string message;
             if (getline(cin, message)) {
-                sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+                if (message.size() > MAX_MESSAGE) {
+                    cerr << "Message too long, the limit is " << MAX_MESSAGE << " bytes" << endl;
+                } else {
+                    send_line(message);
+                }
             }
             if (message.find("/quit") == 0) {
                 cout << BYE_MSG << endl;
@@ -107,4 +139,79 @@ void signal_handler(int signal) {
     sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
     close(socket_fd);
     exit(0);
-}
\ No newline at end of file
+}
+
+// one datagram, or pieces of at most MAX_LENGTH bytes for a longer line
+void send_line(const string &message) {
+    if (message.size() <= MAX_LENGTH) {
+        sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+        return;
+    }
+    int count = (message.size() + FRAG_PIECE_MAX - 1) / FRAG_PIECE_MAX;
+    uint32_t id = htonl(next_id++);
+    for (int i = 0; i < count; i++) {
+        string piece(FRAG_HEADER_LEN, 0);
+        piece[0] = FRAG_MAGIC;
+        piece[1] = count;
+        piece[2] = i;
+        memcpy(&piece[4], &id, 4);
+        piece.append(message, i * FRAG_PIECE_MAX, FRAG_PIECE_MAX);
+        sendto(socket_fd, piece.c_str(), piece.size(), 0, (struct sockaddr *)&server_addr, sizeof(server_addr));
+    }
+}
+
+// a piece as the server sends them: at least two pieces, the index in range, a reserved zero byte and a
+// non-empty piece that fits; any other line is printed as it is
+bool frag_header(const char *data, size_t len) {
+    if (len <= FRAG_HEADER_LEN || len - FRAG_HEADER_LEN > FRAG_PIECE_MAX || data[0] != FRAG_MAGIC || data[3] != 0) {
+        return false;
+    }
+    int count = (unsigned char)data[1];
+    int index = (unsigned char)data[2];
+    return count >= 2 && index < count;
+}
+
+// true once every piece of the line arrived, whole then holds it; lines missing pieces for PARTIAL_MICROS are dropped
+bool reassemble(const char *data, size_t len, string &whole) {
+    int count = (unsigned char)data[1];
+    int index = (unsigned char)data[2];
+    uint32_t id;
+    memcpy(&id, data + 4, 4);
+    id = ntohl(id);
+    long long now = now_micros();
+    for (map<uint32_t, Partial>::iterator it = partial.begin(); it != partial.end();) {
+        if (now - it->second.started >= PARTIAL_MICROS) {
+            it = partial.erase(it);
+        } else {
+            it++;
+        }
+    }
+    if (!partial.count(id) && partial.size() == MAX_PARTIAL) { // ids only go up, the first is the oldest
+        partial.erase(partial.begin());
+    }
+    if (!partial.count(id)) {
+        partial[id].pieces.resize(count);
+        partial[id].started = now;
+    }
+    vector<string> &pieces = partial[id].pieces;
+    if (count != (int)pieces.size() || !pieces[index].empty()) {
+        return false;
+    }
+    pieces[index].assign(data + FRAG_HEADER_LEN, len - FRAG_HEADER_LEN);
+    for (int i = 0; i < count; i++) {
+        if (pieces[i].empty()) {
+            return false;
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        whole += pieces[i];
+    }
+    partial.erase(id);
+    return true;
+}
+
+long long now_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
@@ -1,62 +1,625 @@
 #include <algorithm>
 #include <arpa/inet.h>
-#include <chrono>
+#include <atomic>
 #include <csignal>
+#include <cstdint>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fstream>
-#include <iomanip>
 #include <iostream>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+#include <map>
+#include <memory>
+#include <mutex>
 #include <netinet/in.h>
+#include <poll.h>
+#include <set>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <thread>
+#include <tuple>
 #include <unistd.h>
 #include <unordered_map>
 #include <vector>
 
+// the uring backend is built against the 6.0 headers (multishot recvmsg, buffer rings, synchronous cancel);
+// older ones only get the classic loop and -e uring falls back at startup, -DHAVE_URING=0 forces that
+#if !defined(HAVE_URING) && defined(IORING_RECV_MULTISHOT)
+#define HAVE_URING 1
+#endif
+
 using namespace std;
 
+// rate tokens per second refill it up to burst, a chat line takes one
+struct TokenBucket {
+    double tokens = -1; // starts full on first use
+    long long refilled = 0;
+
+    bool take(double rate, double burst, long long now) {
+        tokens = tokens < 0 ? burst : min(burst, tokens + (now - refilled) * rate / 1000000);
+        refilled = now;
+        if (tokens < 1) {
+            return false;
+        }
+        tokens--;
+        return true;
+    }
+
+    bool full(double rate, double burst, long long now) const { return tokens + (now - refilled) * rate / 1000000 >= burst; }
+};
+
 struct Client {
     int cid;
     string nick_name;
     sockaddr_in address;
     int room;
+    string prefix;         // "<nick_name> " or "<ip:port> ", put in front of every chat line
+    long long last_active; // monotonic micros of the last datagram
+    TokenBucket lines;     // -l
 };
 
-struct Message {
-    int msg_id;
-    int sender_id;
-    bool deliverable;
-    vector<int> clock;
+// client sessions in stable slots: a handle stays valid until its session is removed, removal is O(1)
+// and freed slots are reused, so the table only grows to the most sessions alive at once
+struct ClientTable {
+    vector<Client> slots;
+    vector<bool> used;
+    vector<int> free_slots;
+    size_t count = 0;
+
+    int add(const Client &client) {
+        int handle;
+        if (free_slots.empty()) {
+            handle = slots.size();
+            slots.push_back(client);
+            used.push_back(true);
+        } else {
+            handle = free_slots.back();
+            free_slots.pop_back();
+            slots[handle] = client;
+            used[handle] = true;
+        }
+        count++;
+        return handle;
+    }
+
+    void remove(int handle) {
+        slots[handle] = Client(); // drop the strings
+        used[handle] = false;
+        free_slots.push_back(handle);
+        count--;
+    }
+
+    Client &operator[](int handle) { return slots[handle]; }
+};
+
+struct Member {
+    int cid;
+    sockaddr_in address; // cached send address
+};
+
+struct Datagram {
+    shared_ptr<const string> data; // one buffer may go to every member of a room
+    sockaddr_in address;
+};
+
+// message text borrowed from wherever it already is, a chat line keeps its "<name> " prefix apart from the
+// client's bytes in the receive buffer until something has to own it
+struct Content {
+    string_view prefix;
+    string_view body;
+
+    size_t size() const { return prefix.size() + body.size(); }
+
+    void append_to(string &out) const {
+        out.append(prefix.data(), prefix.size());
+        out.append(body.data(), body.size());
+    }
+};
+
+// frames waiting to share one datagram to a server
+struct Coalescer {
+    string buffer;      // BATCH_MAGIC, then (length, frame) pairs
+    int count = 0;
+    long long deadline; // flush no later than this, monotonic micros
+};
+
+// proposals or agreements for one room's messages from one origin, going to the same servers, sent as one
+// frame once the thread runs out of work, see TOTAL_queue()
+struct TotalBatch {
+    int state;           // PROPOSALS or AGREEMENTS
+    int room;
+    int origin;
+    uint64_t targets;
+    vector<int> entries; // (seq, priority) per message for PROPOSALS, all ours, (seq, priority, proposer) for AGREEMENTS
+};
+
+// a message arriving in pieces, see reassemble()
+struct Reassembly {
+    string buffer;            // from REASSEMBLY_POOL, piece i at i * FRAG_PIECE_MAX until the last one arrives
+    uint16_t lengths[255];    // per piece up to FRAG_MAX_PIECES, 0 until it arrived
+    int count;
+    int arrived = 0;
+    long long started;        // monotonic micros, see evict_idle_clients()
+};
+
+// a sent datagram kept until the peer acknowledges it
+struct Unacked {
+    uint32_t seq;
+    string datagram; // link header included
+    long long sent;  // last (re)transmission, monotonic micros
+};
+
+// reliable link to one peer server, see link_send(); senders may be workers, the receiving side is the I/O thread
+struct Link {
+    mutex lock;
+    uint32_t next_seq = 0;            // last link sequence number sent
+    deque<Unacked> unacked;           // consecutive sequence numbers, oldest first
+    uint32_t expected = 1;            // next sequence number to hand up
+    map<uint32_t, string> early;      // payloads received past a gap
+    uint32_t highest = 0;             // highest sequence number seen, a gap is open while it is >= expected
+    long long nack_sent = 0;          // when the current gap was last NACKed
+    bool ack_pending = false;         // received data the peer has not seen an ACK for
+    long long ack_due = 0;
+    uint32_t peer_epoch = 0;          // the peer's LINK_EPOCH, 0 until we hear from it
+};
+
+#if HAVE_URING
+// io_uring instance of the I/O thread, see uring_start(): the rings are shared with the kernel, datagrams
+// arrive in provided buffers through one multishot receive and every queued send keeps its datagram alive
+// until its completion
+struct Uring {
+    struct Send {
+        Datagram datagram;
+        msghdr msg;
+        iovec iov;
+    };
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned sq_entries;
+    io_uring_sqe *sqes;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    io_uring_cqe *cqes;
+    unsigned queued = 0;         // SQEs written since the last io_uring_enter
+    io_uring_buf_ring *buf_ring;
+    vector<char> buffers;        // URING_BUFFERS receive buffers, URING_STRIDE bytes apart
+    uint16_t buf_tail = 0;       // buffers handed back, published to the kernel after each reap
+    msghdr recv_msg;             // layout of the multishot receive: address only, no control data
+    bool receiving = false;      // the multishot receive is armed
+    int failures = 0;            // receive errors since the last datagram, see uring_reap()
+    int error = 0;               // errno of the last one
+    long long rearm_at = 0;      // the receive is not re-armed before this, backing off from repeated errors
+    vector<Send> sends;          // fixed size, in-flight SQEs point into it
+    vector<int> free_sends;
+};
+#else
+struct Uring;
+#endif
+
+// an I/O backend for socket_fd: start() sets it up or refuses, run() feeds handle_datagram() and the timers for good
+struct EventLoop {
+    const char *name;
+    bool (*start)();
+    void (*run)();
+};
+
+// decoded inter-server message, see encode_header() for both wire layouts
+struct Frame {
+    int state;    // TOTAL: NEW_MSG, PROPOSAL or AGREEMENT, SEQUENCER: SEQ_REQUEST or SEQ_ORDER
+    int proposer; // TOTAL: proposer of msg_id
+    int msg_id;   // FIFO/SEQUENCER: sequence number, TOTAL: priority, CAUSAL: sender
+    int room;
+    vector<int> clock; // CAUSAL only
     string content;
+    int origin; // TOTAL: server that multicast the message
+    int seq;    // TOTAL: origin's sequence number, (origin, seq) names the message
+    long long posted; // wall-clock micros the origin received the chat line, 0 if unknown
 };
 
-struct Comparator {
-    bool operator()(const Message &m1, const Message &m2) const {
-        if (m1.msg_id < m2.msg_id) {
-            return true;
-        } else if (m1.msg_id == m2.msg_id && m1.sender_id < m2.sender_id) {
-            return true;
-        } else {
+// work handed from the I/O thread to the worker that owns a room
+struct Task {
+    int kind;
+    int room;
+    int sender_id;
+    Client client;
+    Frame frame;
+};
+
+// lock-free single-producer single-consumer ring, capacity rounded up to a power of two
+template <typename T> struct SpscQueue {
+    vector<T> slots;
+    size_t mask;
+    alignas(64) atomic<size_t> head{0}; // next slot to pop, written by the consumer only
+    alignas(64) atomic<size_t> tail{0}; // next slot to push, written by the producer only
+
+    explicit SpscQueue(size_t capacity) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize(size);
+        mask = size - 1;
+    }
+
+    bool push(T &&item) {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size()) {
+            return false;
+        }
+        slots[t & mask] = move(item);
+        tail.store(t + 1, memory_order_release);
+        return true;
+    }
+
+    bool pop(T &item) {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) {
+            return false;
+        }
+        item = move(slots[h & mask]);
+        head.store(h + 1, memory_order_release);
+        return true;
+    }
+
+    // in-place variants for large items: fill the slot, then publish() or consume() it
+    T *prepare() {
+        size_t t = tail.load(memory_order_relaxed);
+        if (t - head.load(memory_order_acquire) == slots.size()) {
+            return NULL;
+        }
+        return &slots[t & mask];
+    }
+
+    void publish() { tail.store(tail.load(memory_order_relaxed) + 1, memory_order_release); }
+
+    T *peek() {
+        size_t h = head.load(memory_order_relaxed);
+        if (h == tail.load(memory_order_acquire)) {
+            return NULL;
+        }
+        return &slots[h & mask];
+    }
+
+    void consume() { head.store(head.load(memory_order_relaxed) + 1, memory_order_release); }
+};
+
+// one -v line, rendered later by the logger thread, see log_event()
+struct LogRecord {
+    long long micros; // wall clock
+    int kind;         // LOG_*
+    int a, b;
+    int length;
+    char text[1024]; // MAX_LENGTH, longer text is cut
+};
+
+struct Worker {
+    SpscQueue<Task> queue;
+    thread runner;
+    int wakeup_fd;              // eventfd, written by dispatch() while the worker sleeps
+    atomic<bool> sleeping{false};
+    Worker() : queue(4096), wakeup_fd(eventfd(0, EFD_NONBLOCK)) {}
+};
+
+// out-of-order FIFO messages from one sender in one room, slot = seq % window size
+struct FifoWindow {
+    vector<string> slots;
+    vector<long long> posted;
+    vector<bool> present;
+    int count = 0;
+
+    // allocated on the first gap, senders that never reorder cost nothing
+    void put(int seq, int window, string &&content, long long posted_at) {
+        if (slots.empty()) {
+            slots.resize(window);
+            posted.resize(window);
+            present.assign(window, false);
+        }
+        int i = seq % slots.size();
+        if (!present[i]) {
+            present[i] = true;
+            count++;
+        }
+        slots[i] = move(content);
+        posted[i] = posted_at;
+    }
+
+    // forgets first .. last, for a sender whose delivered count jumped past them
+    void drop(int first, int last) {
+        for (int seq = first; seq <= last && seq - first < (int)slots.size() && count > 0; seq++) {
+            int i = seq % slots.size();
+            if (present[i]) {
+                present[i] = false;
+                slots[i].clear();
+                count--;
+            }
+        }
+    }
+
+    bool take(int seq, string &content, long long &posted_at) {
+        if (count == 0 || !present[seq % slots.size()]) {
             return false;
         }
+        int i = seq % slots.size();
+        content = move(slots[i]);
+        posted_at = posted[i];
+        present[i] = false;
+        count--;
+        return true;
     }
 };
 
-struct Comparator2 {
-    bool operator()(const Message &m1, const Message &m2) const {
-        if (m1.msg_id > m2.msg_id) {
-            return true;
-        } else if (m1.msg_id == m2.msg_id && m1.sender_id < m2.sender_id) {
-            return true;
-        } else {
+// TOTAL holdback of one room: ordered by (priority, proposer, id) and indexed by message id
+struct TotalHoldback {
+    struct Held {
+        int priority;
+        int proposer;
+        bool deliverable;
+        string content;
+        long long posted;
+        long long arrived; // monotonic micros, see room_expire()
+        int attempts;      // re-requests of the agreement so far
+    };
+    set<tuple<int, int, uint64_t>> order;
+    unordered_map<uint64_t, Held> messages;
+
+    size_t size() const { return messages.size(); }
+
+    Held *find(uint64_t id) {
+        unordered_map<uint64_t, Held>::iterator it = messages.find(id);
+        return it == messages.end() ? NULL : &it->second;
+    }
+
+    void insert(uint64_t id, int priority, int proposer, string content, long long posted, long long arrived) {
+        if (messages.count(id)) {
+            return;
+        }
+        order.insert(make_tuple(priority, proposer, id));
+        messages[id] = {priority, proposer, false, move(content), posted, arrived, 0};
+    }
+
+    void erase(uint64_t id) {
+        unordered_map<uint64_t, Held>::iterator it = messages.find(id);
+        if (it != messages.end()) {
+            order.erase(make_tuple(it->second.priority, it->second.proposer, id));
+            messages.erase(it);
+        }
+    }
+
+    // re-key the message at its agreed position, false for an unknown id
+    bool agree(uint64_t id, int priority, int proposer) {
+        unordered_map<uint64_t, Held>::iterator it = messages.find(id);
+        if (it == messages.end()) {
             return false;
         }
+        order.erase(make_tuple(it->second.priority, it->second.proposer, id));
+        it->second.priority = priority;
+        it->second.proposer = proposer;
+        it->second.deliverable = true;
+        order.insert(make_tuple(priority, proposer, id));
+        return true;
+    }
+
+    bool front_deliverable() const { return !order.empty() && messages.at(get<2>(*order.begin())).deliverable; }
+
+    Held pop_front() {
+        uint64_t id = get<2>(*order.begin());
+        order.erase(order.begin());
+        Held held = move(messages[id]);
+        messages.erase(id);
+        return held;
+    }
+};
+
+// CAUSAL holdback of one room, each message parked under the (sender, seq) it is still waiting for
+struct CausalHoldback {
+    struct Held {
+        int sender;
+        vector<int> clock;
+        string content;
+        long long posted;
+        long long arrived;     // monotonic micros, set by the first park
+    };
+    unordered_map<uint64_t, vector<Held>> waiting;
+    size_t count = 0;
+
+    size_t size() const { return count; }
+
+    void park(uint64_t dependency, Held &&held) {
+        waiting[dependency].push_back(move(held));
+        count++;
+    }
+
+    // takes out everything parked since before cutoff
+    void expire(long long cutoff, vector<Held> &expired) {
+        for (unordered_map<uint64_t, vector<Held>>::iterator it = waiting.begin(); it != waiting.end();) {
+            vector<Held> &parked = it->second;
+            for (size_t i = 0; i < parked.size();) {
+                if (parked[i].arrived <= cutoff) {
+                    expired.push_back(move(parked[i]));
+                    parked[i] = move(parked.back());
+                    parked.pop_back();
+                    count--;
+                } else {
+                    i++;
+                }
+            }
+            it = parked.empty() ? waiting.erase(it) : ++it;
+        }
+    }
+
+    // hand back everything that was waiting for the message just delivered
+    void wake(uint64_t delivered, vector<Held> &ready) {
+        unordered_map<uint64_t, vector<Held>>::iterator it = waiting.find(delivered);
+        if (it == waiting.end()) {
+            return;
+        }
+        count -= it->second.size();
+        for (size_t i = 0; i < it->second.size(); i++) {
+            ready.push_back(move(it->second[i]));
+        }
+        waiting.erase(it);
+    }
+};
+
+// holdback sizes of one room, stored by the room's owner after every change and read by /stats
+struct RoomGauges {
+    atomic<int> fifo{0};
+    atomic<int> total{0};
+    atomic<int> causal{0};
+    atomic<int> sequencer{0};
+    atomic<int> proposals{0};
+};
+
+// highest (priority, proposer) proposed so far for one of our messages
+struct Proposal {
+    int priority;
+    int proposer;
+    uint64_t participants; // servers the message went to, each owes a proposal
+    uint64_t proposed;     // the ones that did
+    long long started;     // monotonic micros, restarted by every re-request
+    int attempts;          // re-requests so far
+};
+
+// an agreement heard, kept a while to answer participants that ask for it again and to ignore late copies
+// of the message, see room_expire()
+struct Agreed {
+    int priority;
+    int proposer;
+    long long at; // monotonic micros
+};
+
+// what another server last announced about a room, see room_announce()
+struct RoomPeer {
+    uint32_t incarnation = 0; // 0 until the first announcement
+    uint32_t occupancy = 0;   // version of the last occupancy applied, see room_announced()
+    int sent = 0;             // its FIFO sequence number
+    int clock = 0;            // its own CAUSAL clock entry
+    int assigned = 0;         // SEQUENCER numbers handed out, meaningful from the room's home server
+};
+
+// one room's members and ordering state, created on first use and reclaimed once it is quiet on every
+// server, see room_reclaim(), only the room's owner thread touches it
+struct Room {
+    int id;
+    uint32_t incarnation;     // tells peers this server's counters for the room started over
+    vector<Member> members;   // local clients, for delivery fan-out
+    bool announced = false;   // peers have seen this incarnation
+    bool occupied = false;    // last occupancy announced
+    uint32_t occupancy = 0;   // bumped by every change of occupied, peers ignore announcements older than the last they applied
+    vector<RoomPeer> peers;   // per server
+    uint64_t interest = 0;    // bit per server with members here, ours included, the room's traffic only goes there
+    uint64_t syncing = 0;     // bit per peer that has not answered since our first member joined
+    long long sync_started = 0; // when our first member joined
+    long long sync_sent = 0;  // last announcement asking for the answers
+    vector<Member> joining;   // not yet welcomed, see room_welcome()
+
+    // FIFO
+    int S = 0;                // sequence number
+    vector<int> R;            // latest delivered sequence numbers
+    vector<FifoWindow> fifo_holdback;
+
+    // TOTAL
+    TotalHoldback total_holdback;
+    unordered_map<uint64_t, Proposal> proposals; // keyed by message id
+    unordered_map<uint64_t, Agreed> agreed;       // agreements heard lately, only kept with -T
+    deque<uint64_t> agreed_order;                 // their ids, oldest first
+    int P = 0;
+    int A = 0;
+    int total_seq = 0;        // sequence numbers of the messages this server originates
+
+    // CAUSAL
+    CausalHoldback causal_holdback;
+    vector<int> clock;
+
+    // SEQUENCER
+    int seq_assigned = 0;     // last sequence number handed out, on the home server
+    int seq_delivered = 0;    // last sequence number delivered
+    FifoWindow seq_holdback;
+
+    RoomGauges *gauges;       // registered in GAUGES for /stats
+    int held = 0;             // holdback messages last added to HELD
+};
+
+// open-addressing index from a packed IPv4 address + port to a server or client slot
+struct AddrIndex {
+    static const uint64_t EMPTY = ~0ULL;
+    struct Entry {
+        uint64_t key;
+        int source;
+        int idx;
+    };
+    vector<Entry> table = vector<Entry>(64, {EMPTY, 0, 0});
+    size_t count = 0;
+
+    size_t slot(uint64_t key) const { return (key * 0x9E3779B97F4A7C15ULL) >> 32 & (table.size() - 1); }
+
+    const Entry *find(uint64_t key) const {
+        for (size_t i = slot(key);; i = (i + 1) & (table.size() - 1)) {
+            if (table[i].key == key) {
+                return &table[i];
+            } else if (table[i].key == EMPTY) {
+                return NULL;
+            }
+        }
+    }
+
+    void put(uint64_t key, int source, int idx) {
+        if ((count + 1) * 2 > table.size()) { // keep load factor under 1/2
+            vector<Entry> old = table;
+            table.assign(old.size() * 2, {EMPTY, 0, 0});
+            count = 0;
+            for (size_t i = 0; i < old.size(); i++) {
+                if (old[i].key != EMPTY) {
+                    put(old[i].key, old[i].source, old[i].idx);
+                }
+            }
+        }
+        size_t i = slot(key);
+        while (table[i].key != EMPTY && table[i].key != key) {
+            i = (i + 1) & (table.size() - 1);
+        }
+        if (table[i].key == EMPTY) {
+            count++;
+        }
+        table[i] = {key, source, idx};
+    }
+
+    // backward-shift deletion, so lookups never need tombstones
+    void erase(uint64_t key) {
+        size_t mask = table.size() - 1;
+        size_t i = slot(key);
+        while (table[i].key != key) {
+            if (table[i].key == EMPTY) {
+                return;
+            }
+            i = (i + 1) & mask;
+        }
+        size_t j = i;
+        while (true) {
+            j = (j + 1) & mask;
+            if (table[j].key == EMPTY) {
+                break;
+            }
+            size_t home = slot(table[j].key);
+            if (((j - home) & mask) >= ((j - i) & mask)) { // entry j may move back into the hole
+                table[i] = table[j];
+                i = j;
+            }
+        }
+        table[i].key = EMPTY;
+        count--;
     }
 };
 
@@ -69,58 +632,354 @@ const char *JOIN_ERR_MSG = "-ERR You are already in room #";
 const char *ARG_ERR_MSG = "-ERR An argument is needed.";
 const char *UNKNOWN_ERR_MSG = "-ERR Unknown command.";
 const char *ROOM_ERR_MSG = "-ERR There are only chat rooms.";
+const char *CLIENT_RATE_ERR_MSG = "-ERR Slow down, you are sending too fast.";
+const char *ROOM_RATE_ERR_MSG = "-ERR Slow down, this room is too busy.";
+const char *SHED_ERR_MSG = "-ERR The server is busy, try again later.";
+const char *LONG_ERR_MSG = "-ERR Message too long.";
+const char *IDLE_ERR_MSG = "-ERR Disconnected after being idle, send anything to start over.";
 const char *PREFIX = "03:48:22.004328 S02 ";
 
 const int MAX_LENGTH = 1024;
-const int MAX_CLIENTS = 250;
-const int NUM_OF_ROOMS = 10;
+const int MAX_BATCH = 1024; // UIO_MAXIOV, the most sendmmsg/recvmmsg take per call
+const int MAX_MESSAGE = 65536; // longest chat line, sent in pieces when over MAX_LENGTH
+
+#if HAVE_URING
+const int URING_ENTRIES = 256;  // SQ size, the CQ gets 8 times that for the multishot receive
+const int URING_BUFFERS = 512;  // provided receive buffers, a power of two
+const int URING_SENDS = 1024;   // sends in flight at once, more go out through sendto()
+const int URING_BUFFER_LEN = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + MAX_LENGTH;
+const int URING_STRIDE = URING_BUFFER_LEN + 1; // room for the terminator handle_datagram() writes
+const uint64_t URING_RECV = UINT64_MAX;        // user_data of the receive, a send carries its slot
+const int URING_RECV_RETRIES = 8;              // receive errors in a row before the classic loop takes over
+#endif
+
+const int TASK_POST = 1;    // chat line from a local client
+const int TASK_DELIVER = 2; // datagram from a server
+const int TASK_JOIN = 3;
+const int TASK_LEAVE = 4;
+
+const int WIRE_TEXT = 0;   // legacy "+"-delimited ASCII
+const int WIRE_BINARY = 1; // fixed header + length-prefixed payload
+const int WIRE_VERSION = 3;
+const int WIRE_FIELDS = 6; // room, proposer, msg_id, origin, seq, payload length
+const int WIRE_HEADER_LEN = 4 + 4 * WIRE_FIELDS + 8; // the fields, then the 64-bit posted time
+
+const int LATENCY_BUCKETS = 25; // bucket i counts client-to-delivery latencies below 2^i micros, the last one the rest
+
+const char BATCH_MAGIC = (char)0xB7; // coalesced datagram, never a WIRE_VERSION or a digit
+
+const char LINK_MAGIC = (char)0xA5; // reliable link header, see link_send()
+const int LINK_HEADER_LEN = 20;      // magic, type, 2 reserved, u32 seq, u32 cumulative ack, u32 sender epoch, u32 receiver epoch
+const int LINK_DATA = 1;
+const int LINK_ACK = 2;  // cumulative ack only
+const int LINK_NACK = 3; // u32 sequence numbers the receiver is missing
+const int LINK_SKIP = 4; // seq is the oldest datagram still held, everything before it is gone
+const int LINK_NACK_MAX = 64;
+const int LINK_RESEND_MAX = 32;      // timeout retransmissions per peer per tick
+const int LINK_TICK_MICROS = 2000;
+const int LINK_ACK_MICROS = 2000;    // a standalone ACK waits this long for a datagram to ride on
+const int LINK_NACK_MICROS = 10000;  // re-NACK a gap that is still open
+const int LINK_REORDER_MICROS = 1000; // first NACK only once a gap outlives plain reordering
+const int LINK_RTO_MICROS = 30000;   // retransmit what stayed unacknowledged this long
+
+const char FRAG_MAGIC = (char)0xF3; // one piece of a datagram too long to send whole, from a server or a client
+const int FRAG_HEADER_LEN = 8;      // magic, u8 piece count, u8 piece index, reserved, u32 message id
+const int FRAG_PIECE_MAX = MAX_LENGTH - FRAG_HEADER_LEN;
+const int FRAG_MAX_PIECES = 255;
+const int MAX_FRAME = MAX_LENGTH - LINK_HEADER_LEN - 3; // longest server frame that still fits with the link header and a coalescing length
+const int REASSEMBLY_MAX = 32;          // client messages reassembled at once, pieces of more are dropped
+const int REASSEMBLY_PER_CLIENT = 2;    // of those from one client address
+const int REASSEMBLY_PEER_MAX = 32;     // peer server frames reassembled at once, a budget of their own
+const int REASSEMBLY_POOL_MAX = 8;      // buffers kept for the next ones
+const int REASSEMBLY_MICROS = 2000000;  // a message still missing pieces after this is dropped
+
+const int LOG_NEW_CLIENT = 1;    // a = cid
+const int LOG_CLIENT_POST = 2;   // a = cid, b = room
+const int LOG_MALFORMED = 3;     // a = server
+const int LOG_LINK_MISMATCH = 4; // a = server
+const int LOG_SERVER_SENDS = 5;  // a = server
+const int LOG_DELIVERED = 6;     // a = cid, b = room
+const int LOG_FIFO_BEYOND = 7;   // a = server, b = room, text = msg_id
+const int LOG_RING_SIZE = 1024;  // records per thread, a full ring drops new ones
+
+const int SOURCE_UNKNOWN = 0;
+const int SOURCE_SERVER = 1;
+const int SOURCE_CLIENT = 2;
 
 void initialize();
-string timestamp_prefix();
-bool compare_addr(sockaddr_in add1, sockaddr_in add2);
+bool classic_start();
+void classic_run();
+bool uring_start();
+void uring_run();
+#if HAVE_URING
+void uring_enter(Uring &ring, bool wait);
+io_uring_sqe *uring_sqe(Uring &ring);
+void uring_arm_receive(Uring &ring);
+void uring_reap(Uring &ring);
+void uring_recycle(Uring &ring, int bid);
+void uring_fall_back(Uring &ring);
+#endif
+void uring_send_outbox(Uring &ring);
+void uring_stop();
+void handle_datagram(char *buffer, ssize_t bytes_received, const sockaddr_in &src_addr);
+void set_prefix(Client &client);
+void remove_client(int handle);
+bool frag_header(const char *data, size_t len);
+bool reassemble(map<pair<uint64_t, uint32_t>, Reassembly> &messages, size_t max, int per_source, uint64_t source, const char *data, size_t len, string &whole);
+bool fragment(const string &whole, size_t piece, vector<string> &pieces);
+void evict_idle_clients();
+const char *admit_line(Client &client, long long now);
+void send_datagram(int fd, const string &data, const sockaddr_in &addr);
+void send_datagram(int fd, const iovec *iov, int count, const sockaddr_in &addr);
+void flush_outbox(int fd);
+void wait_readable(long long deadline);
+bool receive_blocks(long long deadline);
+long long next_deadline();
+long long coalesce_deadline();
+long long room_deadline(int owner, bool periodic);
+long long room_expiry_micros();
+long long now_micros();
+void send_to_server(int fd, int server, const string &header, Content content);
+void flush_coalesced(int fd, bool force);
+void receive_frame(int sender_id, const char *data, size_t len);
+void receive_payload(int sender_id, const char *data, size_t len);
+void link_send(int fd, int server, const string &header, Content content);
+void link_receive(int fd, int server, const char *buffer, size_t len);
+void link_timers(int fd);
+void link_drain(Link &link, vector<string> &ready);
+string link_header(const Link &link, int type, uint32_t seq);
+bool seq_before(uint32_t a, uint32_t b);
+uint64_t message_id(int origin, int seq);
+string encode_header(const Frame &frame, size_t length);
+bool decode_frame(const char *buffer, size_t len, Frame &frame);
+bool frame_ids_valid(const Frame &frame);
+void dispatch(Task &&task);
+void run_task(Task &task);
+void worker_loop(int w);
+void worker_sleep(int w);
+void update_membership(int kind, int room, const Client &client);
+void post_message(int room, Content content, long long posted);
+void multicast_message(int room, Content content, long long posted);
+void deliver_message(int sender_id, Frame &frame);
+void log_event(int kind, int a, int b, Content text);
+void log_event(int kind, int a, int b, string_view text);
+void logger_loop();
+void log_render(const LogRecord &record, string &out);
+uint64_t addr_key(const sockaddr_in &addr);
 void signal_handler(int signal);
-string clock_to_string(int group_id);
-void basic_deliver(int fd, int room, string content);
-void basic_multicast(int fd, string content);
-void FIFO_deliver(int socket_fd, int sender_id, char *buffer);
-void FIFO_multicast(int socket_fd, int cur_client_idx, string str_content);
-void TOTAL_deliver(int socket_fd, int sender_id, char *buffer);
-void TOTAL_multicast(int socket_fd, int cur_client_idx, string str_content);
-void CAUSAL_deliver(int socket_fd, int sender_id, char *buffer);
-void CAUSAL_multicast(int socket_fd, int cur_client_idx, string str_content);
+void shutdown_server();
+int room_owner(int room);
+Room *room_find(int room);
+Room &room_get(int room);
+void room_add(int room, const Client &client);
+void room_remove(int room, int cid);
+void room_settle(Room &room);
+void room_announce(Room &room, uint64_t targets, bool answer);
+void room_announced(int sender_id, Frame &frame);
+void room_adopt(Room &room, int sender_id, bool restarted);
+void room_occupy(Room &room, bool occupied);
+void room_welcome(Room &room);
+void room_timers(int owner);
+void room_expire(Room &room, long long now);
+void room_reclaim(Room &room);
+void basic_deliver(int fd, Room &room, Content content, long long posted);
+void basic_deliver(int fd, Room &room, string &&content, long long posted);
+void fan_out(int fd, Room &room, Content content, const shared_ptr<const string> &joined);
+void send_to_client(int fd, const string &data, const sockaddr_in &addr);
+void record_latency(long long posted);
+void update_gauges(Room &room);
+string stats_snapshot();
+long long wall_micros();
+void basic_multicast(int fd, uint64_t targets, const string &header, Content content);
+void FIFO_deliver(int socket_fd, int sender_id, Room &room, Frame &frame);
+void FIFO_drain(int socket_fd, Room &room, int sender_id);
+void FIFO_multicast(int socket_fd, Room &room, Content content, long long posted);
+void TOTAL_deliver(int socket_fd, int sender_id, Room &room, Frame &frame);
+void TOTAL_multicast(int socket_fd, Room &room, Content content, long long posted);
+void TOTAL_drain(int socket_fd, Room &room);
+void TOTAL_propose(int sender_id, Room &room, int origin, int seq, int priority, int proposer);
+bool TOTAL_agree(Room &room, int origin, int seq, int priority, int proposer);
+void TOTAL_queue(int state, Room &room, uint64_t targets, int origin, int seq, int priority, int proposer);
+void TOTAL_send(int socket_fd, TotalBatch &batch);
+void TOTAL_flush(int socket_fd);
+bool TOTAL_pending();
+void CAUSAL_deliver(int socket_fd, int sender_id, Room &room, Frame &frame);
+void CAUSAL_release(int socket_fd, Room &room, vector<CausalHoldback::Held> &ready);
+void CAUSAL_skip(int socket_fd, Room &room, int sender, int seq);
+void CAUSAL_multicast(int socket_fd, Room &room, Content content, long long posted);
+bool causal_dependency(const vector<int> &clock, int sender, const vector<int> &delivered, uint64_t &dependency);
+void SEQUENCER_deliver(int socket_fd, int sender_id, Room &room, Frame &frame);
+void SEQUENCER_drain(int socket_fd, Room &room);
+void SEQUENCER_stamp(int socket_fd, Room &room, Frame &frame, Content content);
+void SEQUENCER_multicast(int socket_fd, Room &room, Content content, long long posted);
+int home_server(int room);
+bool command_is(string_view line, const char *name);
 
 // FIFO variables
-vector<int> S;         // sequence numbers
-vector<vector<int>> R; // latest delivered sequence numbers
-vector<vector<unordered_map<int, string>>> FIFO_HOLDBACK;
+int FIFO_WINDOW = 1024;              // messages a sender may run ahead of the next expected one
+atomic<long> FIFO_BEYOND_WINDOW(0); // arrivals dropped for being past the window
 
 // TOTAL variables
 const int NEW_MSG = 1;
 const int PROPOSAL = 2;
 const int AGREEMENT = 3;
-vector<vector<Message>> TOTAL_HOLDBACK;
-unordered_map<string, vector<Message>> PROPOSALS;
-vector<int> P;
-vector<int> A;
-
-// CAUSAL variables
-vector<vector<Message>> CAUSAL_HOLDBACK;
-vector<vector<int>> CLOCKS;
+const int PROPOSALS = 7;  // several PROPOSALs in the clock field, always binary
+const int AGREEMENTS = 8; // several AGREEMENTs the same way
+const int TOTAL_BATCH_MAX = 64; // messages per batch, 3 * 64 entries keep an AGREEMENTS frame in one datagram
+thread_local vector<TotalBatch> TOTAL_BATCHES; // see TOTAL_queue()
+atomic<long> TOTAL_FRAMES(0);  // PROPOSAL(S) and AGREEMENT(S) frames sent
+atomic<long> TOTAL_ENTRIES(0); // the proposals and agreements they carried
+
+// what room_expire() does with TOTAL and CAUSAL state that waited longer than -T
+const int EXPIRE_DROP = 0;    // forget it, the message is lost here
+const int EXPIRE_FORCE = 1;   // deliver it with what is known, order may differ across servers
+const int EXPIRE_REQUEST = 2; // ask the missing servers again, then drop, CAUSAL has no one to ask and drops
+const char *EXPIRE_POLICIES[] = {"drop", "force", "request"};
+const int STATE_RETRIES = 2;  // re-requests before an entry is dropped
+long long STATE_TIMEOUT_MICROS = 5000000; // -T, 0 keeps TOTAL and CAUSAL state until it completes
+int EXPIRE_POLICY = EXPIRE_REQUEST;       // -P
+int ROOM_STATE_CAP = 10000;               // -M, TOTAL or CAUSAL messages one room may hold, more are refused
+atomic<long> EXPIRED[3];                  // entries expired, per EXPIRE_* policy applied
+atomic<long> CAPPED(0);                   // messages refused by -M
+
+// SEQUENCER variables
+const int SEQ_REQUEST = 4; // origin -> home server of the room
+const int SEQ_ORDER = 5;   // home server -> all, msg_id is the room's global sequence number
+
+// room registry
+const int ROOM_ANNOUNCE = 6; // any order: proposer = ANNOUNCE_* flags, msg_id = FIFO S, origin = incarnation, seq = SEQUENCER assigned, clock = own CAUSAL entry + occupancy version
+const int ANNOUNCE_OCCUPIED = 1; // the sender has members in the room
+const int ANNOUNCE_SYNC = 2;     // the sender needs our counters as of when we route to it, unicast an answer
+const int ANNOUNCE_ANSWER = 4;   // such an answer, never asks for one itself
+const int ROOM_RESYNC_MICROS = 100000; // unanswered sync requests are repeated this often
+const int ROOM_REANNOUNCE_MICROS = 1000000; // every room's occupancy is repeated this often, a lost announcement heals without -r
+long long ROOM_SYNC_PATIENCE_MICROS = 1000000; // -j, joiners are let in anyway after this: every join takes this long while a peer
+                                               // is down, and a peer answering later may have sent lines the joiner misses
+const int MAX_SERVERS = 64;            // interest bitmaps are 64 bits
+vector<unordered_map<int, Room *>> ROOMS; // per owner thread, see room_owner()
+vector<set<int>> ROOMS_SYNCING;           // per owner thread, rooms waiting for answers
+vector<long long> ROOMS_NEXT_EXPIRY;      // per owner thread, next room_expire() sweep
+vector<long long> ROOMS_NEXT_ANNOUNCE;    // per owner thread, next repeat of every room's announcement
+uint64_t PEER_SERVERS = 0;                // bit per server but ourselves
+atomic<long> VACANT_DROPS(0);             // frames that reached a room after its last member here left
+atomic<uint32_t> ROOM_INCARNATION;
+atomic<long> ROOMS_RECLAIMED(0);
 
 // shared variables
-vector<Client> CLIENTS;
+ClientTable CLIENTS;
+long long CLIENT_NEXT_SWEEP = 0; // I/O thread only
+atomic<long> CLIENTS_EVICTED(0);
+unordered_map<int, TokenBucket> ROOM_LINES; // I/O thread only, per room with recent lines, see admit_line()
+atomic<long> THROTTLED[2];                  // lines refused by the client and by the room bucket
+atomic<long> SHED(0);                       // lines refused by admission control
+atomic<long> HELD(0);                       // messages in every room's holdbacks, see update_gauges()
+map<pair<uint64_t, uint32_t>, Reassembly> REASSEMBLING;       // I/O thread only, by client address and message id
+map<pair<uint64_t, uint32_t>, Reassembly> REASSEMBLING_PEERS; // I/O thread only, by server id and message id
+vector<string> REASSEMBLY_POOL;                          // I/O thread only
+atomic<uint32_t> FRAG_NEXT_ID(0);
+atomic<long> FRAGMENTS_SENT(0);
+atomic<long> REASSEMBLED(0);
+atomic<long> REASSEMBLY_DROPS[2]; // messages that timed out, and pieces refused
 vector<sockaddr_in> SERVERS;
+AddrIndex ADDRS; // servers and clients keyed by address
+thread_local vector<Datagram> OUTBOX; // datagrams queued until the end of a receive batch
+vector<Worker *> WORKERS;                // a room is owned by one worker, see room_owner()
+thread_local vector<Coalescer> COALESCE; // per destination server
+atomic<long> COALESCED_FRAMES(0);
+atomic<long> COALESCED_DATAGRAMS(0);
+atomic<long> COALESCED_BYTES(0);
+vector<Link *> LINKS;          // per peer server
+long long LINK_NEXT_TICK = 0;  // I/O thread only
+uint32_t LINK_EPOCH;           // this incarnation, a peer that sees it change starts both directions over
+atomic<long> LINK_RETRANSMITS(0);
+atomic<long> LINK_NACKS(0);
+atomic<long> LINK_DUPLICATES(0);
+atomic<long> LINK_OVERFLOWS(0); // datagrams pushed out of a full retransmit buffer
+atomic<long> LINK_RESTARTS(0);  // peers seen coming back with a new epoch
+atomic<long> RECEIVED[3]; // datagrams per SOURCE_*
+atomic<long> SENT[3];     // datagrams to SOURCE_SERVER and SOURCE_CLIENT, link control and retransmits not included
+atomic<long> MALFORMED(0); // server frames decode_frame() refused, see frame_ids_valid()
+atomic<long> LATENCY[LATENCY_BUCKETS];
+atomic<long> LATENCY_SUM(0); // micros
+map<int, RoomGauges *> GAUGES; // per live room, changed only when a room is created or reclaimed
+mutex GAUGES_LOCK;
+#ifdef COUNT_ALLOCATIONS
+atomic<long> ALLOCATIONS(0); // operator new calls, see below
+#endif
+atomic<long> POSTED(0);      // chat lines from local clients
+thread_local SpscQueue<LogRecord> *LOG_RING = NULL; // this thread's records, registered in LOG_RINGS on first use
+vector<SpscQueue<LogRecord> *> LOG_RINGS;
+mutex LOG_RINGS_LOCK;
+thread LOGGER;
+atomic<bool> LOG_STOP(false);
+atomic<long> LOG_DROPPED(0);
 
 bool FLAG_DEBUG = false;
 int self_id = 0;
 int ORDER = 0; // default as unordered
+int NUM_WORKERS = 0; // 0 runs the ordering logic on the I/O thread
+volatile sig_atomic_t STOPPING = 0; // set by SIGINT
+const long long RECV_TIMEOUT_MICROS = 100000; // the socket's SO_RCVTIMEO, the longest an I/O thread wait lasts
+int BATCH_SIZE = 1; // datagrams per recvmmsg, 1 keeps the one-at-a-time path
+int WIRE_FORMAT = WIRE_BINARY;
+int COALESCE_BYTES = 0;    // flush a server's coalesced frames at this size, 0 sends every frame alone
+int COALESCE_MICROS = 200; // or once the oldest frame waited this long
+const int MAX_COALESCE_MICROS = 1000000; // -d beyond a second would only stall the links
+int LINK_WINDOW = 0;       // datagrams kept per peer for retransmission, 0 sends raw unacknowledged UDP
+int NUM_OF_ROOMS = 10;     // highest room number, state only exists for rooms in use
+long long CLIENT_IDLE_MICROS = 0; // -i, sessions silent this long are dropped, 0 keeps them forever since listeners never send
+double CLIENT_LINE_RATE = 0; // chat lines per second per client, 0 is unlimited, bursts of a second's worth
+double ROOM_LINE_RATE = 0;   // the same per room, over all of this server's clients in it
+long ADMIT_HELD = 100000;    // new chat lines are shed while the holdbacks hold more messages than this, 0 never sheds
 int socket_fd;
 int next_cid = 1;
 
+const EventLoop EVENT_LOOPS[] = {{"classic", classic_start, classic_run}, {"uring", uring_start, uring_run}};
+int EVENT_LOOP = 0;               // -e, falls back to classic when the backend cannot start
+thread_local Uring *URING = NULL; // the I/O thread's ring while the uring backend runs
+int URING_FD = -1;                // the same ring for uring_stop(), which may run on any thread
+atomic<long> SYSCALLS(0);         // socket receives, sends, polls and io_uring_enter calls
+
+// a reassembled message, its buffer goes back to REASSEMBLY_POOL with the scope
+struct PooledBuffer {
+    string data;
+
+    ~PooledBuffer() {
+        if (data.capacity() > 0 && REASSEMBLY_POOL.size() < REASSEMBLY_POOL_MAX) {
+            data.clear();
+            REASSEMBLY_POOL.push_back(move(data));
+        }
+    }
+};
+
+#ifdef COUNT_ALLOCATIONS
+// counted so /stats and the exit summary can show the heap traffic per chat line; a shared counter on every
+// allocation costs, so only in a build made with CXXFLAGS=-DCOUNT_ALLOCATIONS
+void *operator new(size_t size) {
+    ALLOCATIONS.fetch_add(1, memory_order_relaxed);
+    void *p = malloc(size == 0 ? 1 : size);
+    if (p == NULL) {
+        throw bad_alloc();
+    }
+    return p;
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+#endif
+
 /* =============================================== main =============================================== */
 int main(int argc, char *argv[]) {
 
-    signal(SIGINT, signal_handler);
+    // SIGINT is blocked in every thread started below and only reaches the I/O thread, see signal_handler()
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = signal_handler;
+    sigaction(SIGINT, &action, NULL);
+    sigset_t sigint;
+    sigemptyset(&sigint);
+    sigaddset(&sigint, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigint, NULL);
 
     if (argc < 2) {
         fprintf(stderr, "*** Author: Zhengjia Mao (zmao)\n");
@@ -128,11 +987,143 @@ int main(int argc, char *argv[]) {
     }
 
     int c;
-    while ((c = getopt(argc, argv, "vo:")) != -1) {
+    while ((c = getopt(argc, argv, "vo:b:t:w:W:c:d:r:n:i:e:l:L:a:T:P:M:j:")) != -1) {
         switch (c) {
         case 'v':
             FLAG_DEBUG = true;
             break;
+        case 'b':
+            BATCH_SIZE = atoi(optarg);
+            if (BATCH_SIZE < 1 || BATCH_SIZE > MAX_BATCH) {
+                cerr << "Batch size must be between 1 and " << MAX_BATCH << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 't':
+            NUM_WORKERS = atoi(optarg);
+            if (NUM_WORKERS < 0) {
+                cerr << "Invalid number of worker threads" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'c':
+            COALESCE_BYTES = atoi(optarg);
+            if (COALESCE_BYTES < 0 || COALESCE_BYTES > MAX_LENGTH) {
+                cerr << "Coalescing threshold must be between 0 and " << MAX_LENGTH << " bytes" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'd':
+            COALESCE_MICROS = atoi(optarg);
+            if (COALESCE_MICROS < 0 || COALESCE_MICROS > MAX_COALESCE_MICROS) {
+                cerr << "Coalescing delay must be between 0 and " << MAX_COALESCE_MICROS << " microseconds" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'r':
+            LINK_WINDOW = atoi(optarg);
+            if (LINK_WINDOW < 0) {
+                cerr << "Invalid retransmit buffer size" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'n':
+            NUM_OF_ROOMS = atoi(optarg);
+            if (NUM_OF_ROOMS < 1) {
+                cerr << "Invalid number of chat rooms" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'i':
+            CLIENT_IDLE_MICROS = atoll(optarg) * 1000000LL;
+            if (CLIENT_IDLE_MICROS < 0) {
+                cerr << "Invalid idle timeout" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'l':
+            CLIENT_LINE_RATE = atof(optarg);
+            if (CLIENT_LINE_RATE < 0) {
+                cerr << "Invalid client line rate" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'L':
+            ROOM_LINE_RATE = atof(optarg);
+            if (ROOM_LINE_RATE < 0) {
+                cerr << "Invalid room line rate" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'a':
+            ADMIT_HELD = atol(optarg);
+            if (ADMIT_HELD < 0) {
+                cerr << "Invalid admission threshold" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'T':
+            STATE_TIMEOUT_MICROS = atoll(optarg) * 1000;
+            if (STATE_TIMEOUT_MICROS < 0) {
+                cerr << "Invalid state timeout" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'P':
+            EXPIRE_POLICY = -1;
+            for (size_t i = 0; i < sizeof(EXPIRE_POLICIES) / sizeof(EXPIRE_POLICIES[0]); i++) {
+                if (strcasecmp(optarg, EXPIRE_POLICIES[i]) == 0) {
+                    EXPIRE_POLICY = i;
+                }
+            }
+            if (EXPIRE_POLICY < 0) {
+                cerr << "Invalid expiry policy" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'M':
+            ROOM_STATE_CAP = atoi(optarg);
+            if (ROOM_STATE_CAP < 1) {
+                cerr << "Invalid room state cap" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'j':
+            ROOM_SYNC_PATIENCE_MICROS = atoll(optarg) * 1000;
+            if (ROOM_SYNC_PATIENCE_MICROS < 0) {
+                cerr << "Invalid join patience" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'e':
+            EVENT_LOOP = -1;
+            for (size_t i = 0; i < sizeof(EVENT_LOOPS) / sizeof(EVENT_LOOPS[0]); i++) {
+                if (strcasecmp(optarg, EVENT_LOOPS[i].name) == 0) {
+                    EVENT_LOOP = i;
+                }
+            }
+            if (EVENT_LOOP < 0) {
+                cerr << "Invalid event loop" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'W':
+            FIFO_WINDOW = atoi(optarg);
+            if (FIFO_WINDOW < 1) {
+                cerr << "Invalid FIFO window size" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        case 'w':
+            if (strcasecmp(optarg, "binary") == 0) {
+                WIRE_FORMAT = WIRE_BINARY;
+            } else if (strcasecmp(optarg, "text") == 0) {
+                WIRE_FORMAT = WIRE_TEXT;
+            } else {
+                cerr << "Invalid wire format" << endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
         case 'o':
             if (strcasecmp(optarg, "unordered") == 0) {
                 ORDER = 0;
@@ -142,6 +1133,8 @@ int main(int argc, char *argv[]) {
                 ORDER = 2;
             } else if (strcasecmp(optarg, "causal") == 0) {
                 ORDER = 3;
+            } else if (strcasecmp(optarg, "sequencer") == 0) {
+                ORDER = 4;
             } else {
                 cerr << "Invalid ordering" << endl;
                 exit(EXIT_FAILURE);
@@ -153,6 +1146,11 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (LINK_WINDOW > 0 && COALESCE_BYTES > MAX_LENGTH - LINK_HEADER_LEN) {
+        cerr << "Coalescing threshold must leave " << LINK_HEADER_LEN << " bytes for the link header" << endl;
+        exit(EXIT_FAILURE);
+    }
+
     // locate the config file
     string file_name = argv[optind];
     ifstream config_file(file_name);
@@ -173,6 +1171,7 @@ int main(int argc, char *argv[]) {
         forward_addr.sin_port = htons(atoi(port.c_str()));
         inet_pton(AF_INET, ip.c_str(), &forward_addr.sin_addr);
         SERVERS.push_back(forward_addr);
+        ADDRS.put(addr_key(forward_addr), SOURCE_SERVER, i);
 
         // bind to the bind address
         if (i == self_id) {
@@ -204,425 +1203,2523 @@ int main(int argc, char *argv[]) {
         i++;
     }
 
+    if (SERVERS.size() > MAX_SERVERS) {
+        cerr << "At most " << MAX_SERVERS << " servers are supported" << endl;
+        exit(EXIT_FAILURE);
+    }
+
     // initialize all queues and variables
     initialize();
 
-    while (1) {
-        // receiving messages
-        char buffer[MAX_LENGTH];
-        struct sockaddr_in src_addr;
-        socklen_t src_len = sizeof(src_addr);
-        ssize_t bytes_received = recvfrom(socket_fd, buffer, MAX_LENGTH, 0, (struct sockaddr *)&src_addr, &src_len);
-        buffer[bytes_received] = '\0';
-        // cout << "Message received: " << buffer << endl;
-
-        // identify the source of the message received
-        string source = "UNKNOWN";
-        int sender_id = 0;
-        for (int i = 0; i < SERVERS.size(); i++) {
-            if (compare_addr(SERVERS[i], src_addr)) {
-                source = "SERVER";
-                sender_id = i;
-                break;
-            }
+    if (FLAG_DEBUG) {
+        LOGGER = thread(logger_loop);
+    }
+
+    // start the workers after all per-room state exists, it is never resized afterwards
+    for (int w = 0; w < NUM_WORKERS; w++) {
+        WORKERS.push_back(new Worker());
+    }
+    for (int w = 0; w < NUM_WORKERS; w++) {
+        WORKERS[w]->runner = thread(worker_loop, w);
+    }
+
+    pthread_sigmask(SIG_UNBLOCK, &sigint, NULL);
+
+    const EventLoop *loop = &EVENT_LOOPS[EVENT_LOOP];
+    if (!loop->start()) {
+        cerr << "The " << loop->name << " event loop is not available, using " << EVENT_LOOPS[0].name << endl;
+        loop = &EVENT_LOOPS[0];
+        loop->start();
+    }
+    loop->run();
+
+    return 0;
+}
+/* =============================================== main =============================================== */
+
+void handle_datagram(char *buffer, ssize_t bytes_received, const sockaddr_in &src_addr) {
+    buffer[bytes_received] = '\0';
+    // cout << "Message received: " << buffer << endl;
+
+    // identify the source of the message received
+    int source = SOURCE_UNKNOWN;
+    int sender_id = 0;
+    const AddrIndex::Entry *entry = ADDRS.find(addr_key(src_addr));
+    if (entry != NULL) {
+        source = entry->source;
+        sender_id = entry->idx;
+    }
+    RECEIVED[source].fetch_add(1, memory_order_relaxed);
+
+    // a piece of a long line from a client in a room, the rest sees the whole line once its last piece arrived;
+    // a line that merely starts with FRAG_MAGIC fails the header check and is handled as it is
+    PooledBuffer whole;
+    if (source != SOURCE_SERVER && frag_header(buffer, bytes_received)) {
+        if (source != SOURCE_CLIENT || CLIENTS[sender_id].room == 0) {
+            REASSEMBLY_DROPS[1]++;
+            return;
+        }
+        if (!reassemble(REASSEMBLING, REASSEMBLY_MAX, REASSEMBLY_PER_CLIENT, addr_key(src_addr), buffer, bytes_received, whole.data)) {
+            return;
+        }
+        buffer = &whole.data[0];
+        bytes_received = whole.data.size();
+    }
+    string_view line(buffer, bytes_received); // commands and chat lines are parsed in place
+
+    // admin probe, answered without registering the sender as a client
+    if (source != SOURCE_SERVER && line.length() == 6 && command_is(line, "/stats")) {
+        send_to_client(socket_fd, stats_snapshot(), src_addr);
+        return;
+    }
+
+    // if unknown: create a new client
+    if (source == SOURCE_UNKNOWN) {
+        Client new_client;
+        new_client.cid = next_cid;
+        new_client.room = 0;
+        new_client.address = src_addr;
+        new_client.last_active = now_micros();
+        set_prefix(new_client);
+        next_cid++;
+        int cur_client_idx = CLIENTS.add(new_client);
+        ADDRS.put(addr_key(src_addr), SOURCE_CLIENT, cur_client_idx);
+
+        string message;
+
+        if (FLAG_DEBUG) {
+            log_event(LOG_NEW_CLIENT, CLIENTS[cur_client_idx].cid, 0, line);
         }
-        if (source != "SERVER") {
-            for (int i = 0; i < CLIENTS.size(); i++) {
-                if (compare_addr(CLIENTS[i].address, src_addr)) {
-                    source = "CLIENT";
-                    sender_id = i;
-                    break;
+
+        if (command_is(line, "/join")) {
+            if (line.length() <= 6) {
+                message = ARG_ERR_MSG;
+            } else {
+                int room = atoi(line.substr(line.find(' ') + 1).data());
+                if (room < 1 || room > NUM_OF_ROOMS) {
+                    message = ROOM_ERR_MSG;
+                } else { // room_add() answers
+                    CLIENTS[cur_client_idx].room = room;
+                    update_membership(TASK_JOIN, room, CLIENTS[cur_client_idx]);
                 }
             }
+        } else if (command_is(line, "/nick")) {
+            if (line.length() <= 6) {
+                message = ARG_ERR_MSG;
+            } else {
+                CLIENTS[cur_client_idx].nick_name = line.substr(line.find(' ') + 1);
+                set_prefix(CLIENTS[cur_client_idx]);
+                message = NICK_OK_MSG + CLIENTS[cur_client_idx].nick_name;
+            }
+        } else {
+            message = JOIN_WARN_MSG;
         }
+        if (!message.empty()) {
+            send_to_client(socket_fd, message, CLIENTS[cur_client_idx].address);
+        }
+    }
 
-        // if unknown: create a new client
-        if (source == "UNKNOWN") {
-            Client new_client;
-            new_client.cid = next_cid;
-            new_client.room = 0;
-            new_client.address = src_addr;
-            CLIENTS.push_back(new_client);
-            next_cid++;
-            int cur_client_idx = CLIENTS.size() - 1;
+    // if from existing client: multicast to other servers
+    else if (source == SOURCE_CLIENT) {
+        int cur_client_idx = sender_id;
+        CLIENTS[cur_client_idx].last_active = now_micros();
 
-            string action = string(buffer);
-            string cmd = string(buffer);
-            transform(action.begin(), action.end(), action.begin(), ::tolower);
-            string message;
+        if (FLAG_DEBUG) {
+            log_event(LOG_CLIENT_POST, CLIENTS[cur_client_idx].cid, CLIENTS[cur_client_idx].room, line);
+        }
 
-            if (FLAG_DEBUG) {
-                string prefix = timestamp_prefix();
-                cout << prefix << " New Client " << CLIENTS[cur_client_idx].cid << " posts: '" << buffer << "'" << endl;
-                // cout << "Current CLIENTS vector size: " << CLIENTS.size() << endl;
-            }
+        if (buffer[0] == '/') { // if client sends a command
+            string message;
 
-            if (action.find("/join") == 0) {
-                if (cmd.length() <= 6) {
+            if (command_is(line, "/join")) {
+                if (line.length() <= 6) {
                     message = ARG_ERR_MSG;
+                } else if (CLIENTS[cur_client_idx].room != 0) {
+                    message = JOIN_ERR_MSG + to_string(CLIENTS[cur_client_idx].room);
                 } else {
-                    int room = stoi(cmd.substr(cmd.find(" ") + 1));
-                    if (room > NUM_OF_ROOMS) {
+                    int room = atoi(line.substr(line.find(' ') + 1).data());
+                    if (room < 1 || room > NUM_OF_ROOMS) {
                         message = ROOM_ERR_MSG;
-                    } else {
-                        message = JOIN_OK_MSG + to_string(room);
+                    } else { // room_add() answers
                         CLIENTS[cur_client_idx].room = room;
+                        update_membership(TASK_JOIN, room, CLIENTS[cur_client_idx]);
                     }
                 }
-            } else if (action.find("/nick") == 0) {
-                if (cmd.length() <= 6) {
+            } else if (line.length() == 5 && command_is(line, "/part")) {
+                if (CLIENTS[cur_client_idx].room != 0) {
+                    message = LEFT_OK_MSG + to_string(CLIENTS[cur_client_idx].room);
+                    update_membership(TASK_LEAVE, CLIENTS[cur_client_idx].room, CLIENTS[cur_client_idx]);
+                    CLIENTS[cur_client_idx].room = 0;
+                } else {
+                    message = JOIN_WARN_MSG;
+                }
+            } else if (command_is(line, "/nick")) {
+                if (line.length() <= 6) {
                     message = ARG_ERR_MSG;
                 } else {
-                    CLIENTS[cur_client_idx].nick_name = cmd.substr(cmd.find(" ") + 1);
+                    CLIENTS[cur_client_idx].nick_name = line.substr(line.find(' ') + 1);
+                    set_prefix(CLIENTS[cur_client_idx]);
                     message = NICK_OK_MSG + CLIENTS[cur_client_idx].nick_name;
                 }
+            } else if (command_is(line, "/quit")) {
+                send_to_client(socket_fd, BYE_MSG, CLIENTS[cur_client_idx].address); // while the session still exists
+                remove_client(cur_client_idx);
+                return;
             } else {
-                message = JOIN_WARN_MSG;
-            }
-            sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&CLIENTS[cur_client_idx].address, sizeof(CLIENTS[cur_client_idx].address));
-        }
-
-        // if from existing client: multicast to other servers
-        else if (source == "CLIENT") {
-            int cur_client_idx = sender_id;
-
-            if (FLAG_DEBUG) {
-                string prefix = timestamp_prefix();
-                cout << prefix << " Existing Client " << CLIENTS[cur_client_idx].cid << " posts: '" << buffer << "' to chat room #" << CLIENTS[cur_client_idx].room << endl;
-            }
-
-            if (buffer[0] == '/') { // if client sends a command
-                string action = string(buffer);
-                string cmd = string(buffer);
-                transform(action.begin(), action.end(), action.begin(), ::tolower);
-                string message;
-
-                if (action.find("/join") == 0) {
-                    if (cmd.length() <= 6) {
-                        message = ARG_ERR_MSG;
-                    } else if (CLIENTS[cur_client_idx].room != 0) {
-                        message = JOIN_ERR_MSG + to_string(CLIENTS[cur_client_idx].room);
-                    } else {
-                        int room = stoi(cmd.substr(cmd.find(" ") + 1));
-                        if (room > NUM_OF_ROOMS) {
-                            message = ROOM_ERR_MSG;
-                        } else {
-                            CLIENTS[cur_client_idx].room = room;
-                            message = JOIN_OK_MSG + to_string(CLIENTS[cur_client_idx].room);
-                        }
-                    }
-                } else if (action == "/part") {
-                    if (CLIENTS[cur_client_idx].room != 0) {
-                        message = LEFT_OK_MSG + to_string(CLIENTS[cur_client_idx].room);
-                        CLIENTS[cur_client_idx].room = 0;
-                    } else {
-                        message = JOIN_WARN_MSG;
-                    }
-                } else if (action.find("/nick") == 0) {
-                    if (cmd.length() <= 6) {
-                        message = ARG_ERR_MSG;
-                    } else {
-                        CLIENTS[cur_client_idx].nick_name = cmd.substr(cmd.find(" ") + 1);
-                        message = NICK_OK_MSG + CLIENTS[cur_client_idx].nick_name;
-                    }
-                } else if (action.find("/quit") == 0) {
-                    message = BYE_MSG;
-                    CLIENTS.erase(CLIENTS.begin() + cur_client_idx);
-                    // if (FLAG_DEBUG) {
-                    //     cout << "Current CLIENTS size: " << CLIENTS.size() << endl;
-                    // }
-                } else {
-                    message = UNKNOWN_ERR_MSG;
+                message = UNKNOWN_ERR_MSG;
+            }
+            if (!message.empty()) {
+                send_to_client(socket_fd, message, CLIENTS[cur_client_idx].address);
+            }
+
+        } else { // if client sends a message
+            const char *refused;
+            if (CLIENTS[cur_client_idx].room == 0) {
+                string message = JOIN_WARN_MSG;
+                send_to_client(socket_fd, message, CLIENTS[cur_client_idx].address);
+            } else if (line.size() > MAX_MESSAGE) {
+                send_to_client(socket_fd, LONG_ERR_MSG, CLIENTS[cur_client_idx].address);
+            } else if ((refused = admit_line(CLIENTS[cur_client_idx], CLIENTS[cur_client_idx].last_active)) != NULL) {
+                send_to_client(socket_fd, refused, CLIENTS[cur_client_idx].address);
+            } else {
+                // the session's cached "<name> " and the line, which stays in the receive buffer
+                POSTED.fetch_add(1, memory_order_relaxed);
+                post_message(CLIENTS[cur_client_idx].room, {CLIENTS[cur_client_idx].prefix, line}, wall_micros());
+            }
+        }
+    }
+
+    // if from server: deliver the message
+    else if (source == SOURCE_SERVER) {
+        if (buffer[0] == LINK_MAGIC) {
+            link_receive(socket_fd, sender_id, buffer, bytes_received);
+        } else {
+            receive_payload(sender_id, buffer, bytes_received);
+        }
+    }
+}
+
+void set_prefix(Client &client) {
+    if (client.nick_name.empty()) {
+        client.prefix = "<" + string(inet_ntoa(client.address.sin_addr)) + ":" + to_string(client.address.sin_port) + "> ";
+    } else {
+        client.prefix = "<" + client.nick_name + "> ";
+    }
+}
+
+// leaves the client's room and frees its slot, the address becomes unknown again
+void remove_client(int handle) {
+    Client &client = CLIENTS[handle];
+    if (client.room != 0) {
+        update_membership(TASK_LEAVE, client.room, client);
+    }
+    ADDRS.erase(addr_key(client.address));
+    CLIENTS.remove(handle);
+}
+
+// a piece as fragment() makes them: at least two pieces, the index in range, a reserved zero byte and a
+// non-empty piece that fits
+bool frag_header(const char *data, size_t len) {
+    if (len <= FRAG_HEADER_LEN || len - FRAG_HEADER_LEN > FRAG_PIECE_MAX || data[0] != FRAG_MAGIC || data[3] != 0) {
+        return false;
+    }
+    int count = (unsigned char)data[1];
+    int index = (unsigned char)data[2];
+    return count >= 2 && index < count;
+}
+
+// adds one piece that passed frag_header() to messages, true once the last one arrived, whole then holds the
+// message in a pooled buffer; pieces of a new message are dropped while max messages, or per_source from the
+// same sender, are reassembled already
+bool reassemble(map<pair<uint64_t, uint32_t>, Reassembly> &messages, size_t max, int per_source, uint64_t source, const char *data, size_t len, string &whole) {
+    int count = (unsigned char)data[1];
+    int index = (unsigned char)data[2];
+    uint32_t id;
+    memcpy(&id, data + 4, 4);
+    pair<uint64_t, uint32_t> key(source, ntohl(id));
+    map<pair<uint64_t, uint32_t>, Reassembly>::iterator it = messages.find(key);
+    if (it == messages.end()) {
+        int from_source = 0;
+        map<pair<uint64_t, uint32_t>, Reassembly>::iterator same = messages.lower_bound(make_pair(source, 0u));
+        for (; same != messages.end() && same->first.first == source && from_source < per_source; same++) {
+            from_source++;
+        }
+        if (messages.size() >= max || from_source >= per_source) {
+            REASSEMBLY_DROPS[1]++;
+            return false;
+        }
+        Reassembly &started = messages[key];
+        if (!REASSEMBLY_POOL.empty()) {
+            started.buffer = move(REASSEMBLY_POOL.back());
+            REASSEMBLY_POOL.pop_back();
+        }
+        started.buffer.resize(count * FRAG_PIECE_MAX);
+        memset(started.lengths, 0, sizeof(started.lengths));
+        started.count = count;
+        started.started = now_micros();
+        it = messages.find(key);
+    }
+    Reassembly &message = it->second;
+    if (message.count != count || message.lengths[index] != 0) { // a duplicate
+        return false;
+    }
+    message.lengths[index] = len - FRAG_HEADER_LEN;
+    memcpy(&message.buffer[index * FRAG_PIECE_MAX], data + FRAG_HEADER_LEN, len - FRAG_HEADER_LEN);
+    if (++message.arrived < message.count) {
+        return false;
+    }
+    size_t size = 0;
+    for (int i = 0; i < message.count; i++) { // close the gaps of the pieces shorter than FRAG_PIECE_MAX
+        memmove(&message.buffer[size], &message.buffer[i * FRAG_PIECE_MAX], message.lengths[i]);
+        size += message.lengths[i];
+    }
+    message.buffer.resize(size);
+    whole.swap(message.buffer);
+    messages.erase(it);
+    REASSEMBLED++;
+    return true;
+}
+
+// cuts a message into pieces of at most piece bytes behind a FRAG header, false and none for one too long
+bool fragment(const string &whole, size_t piece, vector<string> &pieces) {
+    int count = (whole.size() + piece - 1) / piece;
+    if (count > FRAG_MAX_PIECES) {
+        return false;
+    }
+    uint32_t id = htonl(FRAG_NEXT_ID++);
+    pieces.resize(count);
+    for (int i = 0; i < count; i++) {
+        pieces[i].assign(FRAG_HEADER_LEN, 0);
+        pieces[i][0] = FRAG_MAGIC;
+        pieces[i][1] = count;
+        pieces[i][2] = i;
+        memcpy(&pieces[i][4], &id, 4);
+        pieces[i].append(whole, i * piece, piece);
+    }
+    FRAGMENTS_SENT += count;
+    return true;
+}
+
+// I/O thread: drops the sessions that sent nothing for -i seconds, as if they had sent /quit, and the
+// messages whose pieces stopped coming
+void evict_idle_clients() {
+    if (CLIENT_IDLE_MICROS == 0 && ROOM_LINES.empty() && REASSEMBLING.empty() && REASSEMBLING_PEERS.empty()) {
+        return;
+    }
+    long long now = now_micros();
+    if (now < CLIENT_NEXT_SWEEP) {
+        return;
+    }
+    for (size_t i = 0; i < CLIENTS.slots.size() && CLIENT_IDLE_MICROS > 0; i++) {
+        if (CLIENTS.used[i] && now - CLIENTS[i].last_active >= CLIENT_IDLE_MICROS) {
+            send_to_client(socket_fd, IDLE_ERR_MSG, CLIENTS[i].address);
+            remove_client(i);
+            CLIENTS_EVICTED++;
+        }
+    }
+    map<pair<uint64_t, uint32_t>, Reassembly> *partial[] = {&REASSEMBLING, &REASSEMBLING_PEERS};
+    for (int i = 0; i < 2; i++) {
+        for (map<pair<uint64_t, uint32_t>, Reassembly>::iterator it = partial[i]->begin(); it != partial[i]->end();) {
+            if (now - it->second.started >= REASSEMBLY_MICROS) {
+                PooledBuffer expired = {move(it->second.buffer)};
+                it = partial[i]->erase(it);
+                REASSEMBLY_DROPS[0]++;
+            } else {
+                it++;
+            }
+        }
+    }
+    // a refilled room bucket is the same as none
+    for (unordered_map<int, TokenBucket>::iterator it = ROOM_LINES.begin(); it != ROOM_LINES.end();) {
+        if (it->second.full(ROOM_LINE_RATE, max(ROOM_LINE_RATE, 1.0), now)) {
+            it = ROOM_LINES.erase(it);
+        } else {
+            it++;
+        }
+    }
+    CLIENT_NEXT_SWEEP = now + (CLIENT_IDLE_MICROS > 0 ? min(CLIENT_IDLE_MICROS / 4, 1000000LL) : 1000000LL); // evicted within a quarter of the timeout, at most a second late
+}
+
+// a chat line goes out unless the server is shedding load or the client or its room ran out of tokens,
+// otherwise the -ERR reply for the client
+const char *admit_line(Client &client, long long now) {
+    if (ADMIT_HELD > 0 && HELD.load(memory_order_relaxed) > ADMIT_HELD) {
+        SHED++;
+        return SHED_ERR_MSG;
+    }
+    if (CLIENT_LINE_RATE > 0 && !client.lines.take(CLIENT_LINE_RATE, max(CLIENT_LINE_RATE, 1.0), now)) {
+        THROTTLED[0]++;
+        return CLIENT_RATE_ERR_MSG;
+    }
+    if (ROOM_LINE_RATE > 0 && !ROOM_LINES[client.room].take(ROOM_LINE_RATE, max(ROOM_LINE_RATE, 1.0), now)) {
+        THROTTLED[1]++;
+        return ROOM_RATE_ERR_MSG;
+    }
+    return NULL;
+}
+
+// one frame, or a coalesced datagram of them
+void receive_payload(int sender_id, const char *data, size_t len) {
+    if (len == 0 || data[0] != BATCH_MAGIC) {
+        receive_frame(sender_id, data, len);
+        return;
+    }
+    // coalesced datagram: 16-bit length before every frame
+    const char *p = data + 1;
+    const char *end = data + len;
+    while (end - p >= 2) {
+        uint16_t frame_len;
+        memcpy(&frame_len, p, 2);
+        frame_len = ntohs(frame_len);
+        p += 2;
+        if (frame_len > end - p) {
+            break;
+        }
+        receive_frame(sender_id, p, frame_len);
+        p += frame_len;
+    }
+}
+
+void receive_frame(int sender_id, const char *data, size_t len) {
+    if (frag_header(data, len)) {
+        PooledBuffer whole;
+        if (reassemble(REASSEMBLING_PEERS, REASSEMBLY_PEER_MAX, REASSEMBLY_PEER_MAX, sender_id, data, len, whole.data)) {
+            receive_frame(sender_id, whole.data.data(), whole.data.size());
+        }
+        return;
+    }
+    Task task = {TASK_DELIVER, 0, sender_id, {}, {}};
+    if (!decode_frame(data, len, task.frame)) {
+        MALFORMED++;
+        if (FLAG_DEBUG) {
+            log_event(LOG_MALFORMED, sender_id, 0, "");
+        }
+        return;
+    }
+    if (NUM_WORKERS > 0) {
+        task.room = task.frame.room;
+        dispatch(move(task));
+    } else {
+        deliver_message(sender_id, task.frame);
+    }
+}
+
+// the one copy of a chat line is made here when a worker needs it to outlive the receive buffer
+void post_message(int room, Content content, long long posted) {
+    if (NUM_WORKERS > 0) {
+        Task task = {TASK_POST, room, 0, {}, {}};
+        task.frame.content.reserve(content.size());
+        content.append_to(task.frame.content);
+        task.frame.posted = posted;
+        dispatch(move(task));
+    } else {
+        multicast_message(room, content, posted);
+    }
+}
+
+void multicast_message(int room_id, Content content, long long posted) {
+    Room &room = room_get(room_id);
+    if (ORDER == 0) { // Unordered
+        Frame frame = {0, 0, 0, room_id, {}, "", 0, 0, posted};
+        basic_multicast(socket_fd, room.interest, encode_header(frame, content.size()), content);
+
+    } else if (ORDER == 1) { // FIFO
+        FIFO_multicast(socket_fd, room, content, posted);
+
+    } else if (ORDER == 2) { // TOTAL
+        TOTAL_multicast(socket_fd, room, content, posted);
+
+    } else if (ORDER == 3) { // CAUSAL
+        CAUSAL_multicast(socket_fd, room, content, posted);
+
+    } else if (ORDER == 4) { // SEQUENCER
+        SEQUENCER_multicast(socket_fd, room, content, posted);
+    }
+    room_settle(room);
+}
+
+void deliver_message(int sender_id, Frame &frame) {
+    if (frame.room < 1 || frame.room > NUM_OF_ROOMS) {
+        return;
+    }
+    if (frame.state == ROOM_ANNOUNCE) {
+        room_announced(sender_id, frame);
+        return;
+    }
+    // a TOTAL room takes part in the agreement with or without members, everything else addressed to a
+    // room we just left, sent before the peer heard about it, has no one to go to
+    bool creates = (ORDER == 2 && frame.state == NEW_MSG) || (ORDER == 4 && frame.state == SEQ_REQUEST);
+    Room *found = creates ? &room_get(frame.room) : room_find(frame.room);
+    if (found == NULL || (ORDER != 2 && !creates && !(found->interest >> self_id & 1))) {
+        VACANT_DROPS++;
+        return;
+    }
+    Room &room = *found;
+    if (ORDER == 0) {
+        basic_deliver(socket_fd, room, move(frame.content), frame.posted);
+
+    } else if (ORDER == 1) {
+        FIFO_deliver(socket_fd, sender_id, room, frame);
+
+    } else if (ORDER == 2) {
+        TOTAL_deliver(socket_fd, sender_id, room, frame);
+
+    } else if (ORDER == 3) {
+        CAUSAL_deliver(socket_fd, sender_id, room, frame);
+
+    } else if (ORDER == 4) {
+        SEQUENCER_deliver(socket_fd, sender_id, room, frame);
+    }
+    room_settle(room);
+}
+
+// the member lists belong to the room's worker, so changes travel through its queue
+void update_membership(int kind, int room, const Client &client) {
+    if (NUM_WORKERS > 0) {
+        Task task = {kind, room, 0, client, {}};
+        dispatch(move(task));
+    } else if (kind == TASK_JOIN) {
+        room_add(room, client);
+    } else {
+        room_remove(room, client.cid);
+    }
+}
+
+// spins while the worker's queue is full, which pushes back on the I/O thread
+void dispatch(Task &&task) {
+    if (task.room < 1 || task.room > NUM_OF_ROOMS) {
+        return;
+    }
+    Worker *worker = WORKERS[room_owner(task.room)];
+    while (!worker->queue.push(move(task))) {
+        this_thread::yield();
+    }
+    atomic_thread_fence(memory_order_seq_cst); // pairs with worker_sleep(), either it sees the task or we see it asleep
+    if (worker->sleeping.load(memory_order_relaxed) && worker->sleeping.exchange(false)) {
+        uint64_t one = 1;
+        write(worker->wakeup_fd, &one, sizeof(one));
+    }
+}
+
+void run_task(Task &task) {
+    if (task.kind == TASK_POST) {
+        multicast_message(task.room, {"", task.frame.content}, task.frame.posted);
+    } else if (task.kind == TASK_DELIVER) {
+        deliver_message(task.sender_id, task.frame);
+    } else if (task.kind == TASK_JOIN) {
+        room_add(task.room, task.client);
+    } else if (task.kind == TASK_LEAVE) {
+        room_remove(task.room, task.client.cid);
+    }
+}
+
+// runs the ordering logic of its rooms without locks, flushing batched sends whenever it runs dry
+void worker_loop(int w) {
+    Task task;
+    int idle = 0;
+    int ran = 0;
+    while (true) {
+        if (WORKERS[w]->queue.pop(task)) {
+            run_task(task);
+            idle = 0;
+            if (++ran % 256 == 0) { // a worker that never runs dry still sweeps and answers
+                room_timers(w);
+                TOTAL_flush(socket_fd);
+            }
+            continue;
+        }
+        room_timers(w);
+        TOTAL_flush(socket_fd);
+        flush_coalesced(socket_fd, false);
+        flush_outbox(socket_fd);
+        if (++idle < 64) {
+            this_thread::yield();
+        } else {
+            worker_sleep(w);
+            idle = 0;
+        }
+    }
+}
+
+// blocks on the worker's eventfd until dispatch() hands it a task or one of its own deadlines is due
+void worker_sleep(int w) {
+    Worker *worker = WORKERS[w];
+    worker->sleeping.store(true, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (worker->queue.peek() == NULL) {
+        long long deadline = coalesce_deadline();
+        long long rooms = room_deadline(w, false);
+        if (rooms >= 0 && (deadline < 0 || rooms < deadline)) {
+            deadline = rooms;
+        }
+        struct timespec timeout = {0, 0};
+        if (deadline >= 0) {
+            long long wait = max(0LL, deadline - now_micros());
+            timeout = {(time_t)(wait / 1000000), (long)(wait % 1000000 * 1000)};
+        }
+        struct pollfd pfd = {worker->wakeup_fd, POLLIN, 0};
+        ppoll(&pfd, 1, deadline >= 0 ? &timeout : NULL, NULL);
+    }
+    worker->sleeping.store(false, memory_order_relaxed);
+    uint64_t wakeups;
+    read(worker->wakeup_fd, &wakeups, sizeof(wakeups)); // non-blocking, clears a wakeup we may not have waited for
+}
+
+// sends right away in the one-at-a-time mode, otherwise waits for flush_outbox()
+void send_datagram(int fd, const string &data, const sockaddr_in &addr) {
+    iovec iov = {(void *)data.data(), data.size()};
+    send_datagram(fd, &iov, 1, addr);
+}
+
+// gathers the pieces in the kernel, only the batched mode has to join them into an owned buffer
+void send_datagram(int fd, const iovec *iov, int count, const sockaddr_in &addr) {
+    if (BATCH_SIZE == 1 && URING == NULL) {
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = (void *)&addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = (iovec *)iov;
+        msg.msg_iovlen = count;
+        SYSCALLS.fetch_add(1, memory_order_relaxed);
+        sendmsg(fd, &msg, 0);
+        return;
+    }
+    size_t size = 0;
+    for (int i = 0; i < count; i++) {
+        size += iov[i].iov_len;
+    }
+    shared_ptr<string> data = make_shared<string>();
+    data->reserve(size);
+    for (int i = 0; i < count; i++) {
+        data->append((const char *)iov[i].iov_base, iov[i].iov_len);
+    }
+    OUTBOX.push_back({move(data), addr});
+    if (OUTBOX.size() == MAX_BATCH) {
+        flush_outbox(fd);
+    }
+}
+
+void flush_outbox(int fd) {
+    if (OUTBOX.empty()) {
+        return;
+    } else if (URING != NULL) {
+        uring_send_outbox(*URING);
+        return;
+    }
+    static thread_local vector<iovec> iovs;
+    static thread_local vector<mmsghdr> msgs;
+    iovs.resize(OUTBOX.size());
+    msgs.resize(OUTBOX.size());
+    for (size_t i = 0; i < OUTBOX.size(); i++) {
+        iovs[i].iov_base = (void *)OUTBOX[i].data->data();
+        iovs[i].iov_len = OUTBOX[i].data->size();
+        memset(&msgs[i], 0, sizeof(msgs[i]));
+        msgs[i].msg_hdr.msg_name = &OUTBOX[i].address;
+        msgs[i].msg_hdr.msg_namelen = sizeof(OUTBOX[i].address);
+        msgs[i].msg_hdr.msg_iov = &iovs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    size_t sent = 0;
+    while (sent < OUTBOX.size()) {
+        SYSCALLS.fetch_add(1, memory_order_relaxed);
+        int n = sendmmsg(fd, msgs.data() + sent, OUTBOX.size() - sent, 0);
+        if (n <= 0) { // skip the datagram the kernel refused, like a failed sendto
+            n = 1;
+        }
+        sent += n;
+    }
+    OUTBOX.clear();
+}
+
+// frames for servers go through the per-destination coalescer when -c is set
+void send_to_server(int fd, int server, const string &header, Content content) {
+    if (header.size() + content.size() > MAX_FRAME) {
+        string whole = header;
+        content.append_to(whole);
+        vector<string> pieces;
+        fragment(whole, MAX_FRAME - FRAG_HEADER_LEN, pieces);
+        for (size_t i = 0; i < pieces.size(); i++) {
+            send_to_server(fd, server, pieces[i], {});
+        }
+        return;
+    }
+    if (COALESCE_BYTES == 0) {
+        link_send(fd, server, header, content);
+        return;
+    }
+    if (COALESCE.empty()) {
+        COALESCE.resize(SERVERS.size());
+    }
+    Coalescer &batch = COALESCE[server];
+    size_t frame_len = header.size() + content.size();
+    if (batch.count > 0 && batch.buffer.size() + 2 + frame_len > (size_t)COALESCE_BYTES) {
+        flush_coalesced(fd, true);
+    }
+    if (batch.count == 0) {
+        batch.buffer.assign(1, BATCH_MAGIC);
+        batch.deadline = now_micros() + COALESCE_MICROS;
+    }
+    uint16_t len = htons(frame_len);
+    batch.buffer.append((const char *)&len, 2);
+    batch.buffer += header;
+    content.append_to(batch.buffer);
+    batch.count++;
+    if (batch.buffer.size() >= (size_t)COALESCE_BYTES) {
+        flush_coalesced(fd, true);
+    }
+}
+
+// sends every batch whose deadline passed, or every pending batch when forced
+void flush_coalesced(int fd, bool force) {
+    long long now = force ? 0 : now_micros();
+    for (size_t i = 0; i < COALESCE.size(); i++) {
+        Coalescer &batch = COALESCE[i];
+        if (batch.count == 0 || (!force && batch.deadline > now)) {
+            continue;
+        }
+        link_send(fd, i, batch.buffer, {});
+        COALESCED_FRAMES += batch.count;
+        COALESCED_DATAGRAMS++;
+        COALESCED_BYTES += batch.buffer.size();
+        batch.count = 0;
+    }
+}
+
+// blocks until the socket is readable or the deadline passed, SIGINT cuts it short
+void wait_readable(long long deadline) {
+    long long wait = max(0LL, deadline - now_micros());
+    struct timespec timeout = {(time_t)(wait / 1000000), (long)(wait % 1000000 * 1000)};
+    struct pollfd pfd = {socket_fd, POLLIN, 0};
+    SYSCALLS.fetch_add(1, memory_order_relaxed);
+    ppoll(&pfd, 1, &timeout, NULL);
+}
+
+// whether the next receive may block in the kernel, true unless a timer is due before SO_RCVTIMEO would end it
+bool receive_blocks(long long deadline) { return deadline < 0 || deadline - now_micros() >= RECV_TIMEOUT_MICROS; }
+
+// the earliest coalescing deadline, link tick, sync retry or short expiry sweep, -1 if nothing is pending; the idle
+// and reassembly sweeps are a second apart and just run after the next receive or SO_RCVTIMEO
+long long next_deadline() {
+    long long deadline = coalesce_deadline();
+    if (LINK_WINDOW > 0 && (deadline < 0 || LINK_NEXT_TICK < deadline)) {
+        deadline = LINK_NEXT_TICK;
+    }
+    if (NUM_WORKERS == 0) { // the workers keep their own rooms' timers
+        long long rooms = room_deadline(0, true);
+        if (rooms >= 0 && (deadline < 0 || rooms < deadline)) {
+            deadline = rooms;
+        }
+    }
+    return deadline;
+}
+
+// this thread's earliest coalescing deadline, -1 if nothing is pending
+long long coalesce_deadline() {
+    long long deadline = -1;
+    for (size_t i = 0; i < COALESCE.size(); i++) {
+        if (COALESCE[i].count > 0 && (deadline < 0 || COALESCE[i].deadline < deadline)) {
+            deadline = COALESCE[i].deadline;
+        }
+    }
+    return deadline;
+}
+
+// the next sync retry, announcement repeat or expiry sweep of an owner's rooms, -1 if there is none; a periodic
+// caller wakes up every RECV_TIMEOUT_MICROS anyway and leaves repeats and sweeps at least that far apart to those wakeups
+long long room_deadline(int owner, bool periodic) {
+    long long deadline = -1;
+    if (!ROOMS_SYNCING[owner].empty()) {
+        deadline = now_micros() + ROOM_RESYNC_MICROS;
+    }
+    if (!periodic && !ROOMS[owner].empty() && (deadline < 0 || ROOMS_NEXT_ANNOUNCE[owner] < deadline)) {
+        deadline = ROOMS_NEXT_ANNOUNCE[owner];
+    }
+    bool sweeps = STATE_TIMEOUT_MICROS > 0 && !ROOMS[owner].empty() && (!periodic || room_expiry_micros() < RECV_TIMEOUT_MICROS);
+    if (sweeps && (deadline < 0 || ROOMS_NEXT_EXPIRY[owner] < deadline)) {
+        deadline = ROOMS_NEXT_EXPIRY[owner];
+    }
+    return deadline;
+}
+
+// a blocking receive returns at least every RECV_TIMEOUT_MICROS, so the sweeps and a SIGINT that just missed the wait get their turn
+bool classic_start() {
+    struct timeval timeout = {RECV_TIMEOUT_MICROS / 1000000, RECV_TIMEOUT_MICROS % 1000000};
+    setsockopt(socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return true;
+}
+
+// recvfrom(), or recvmmsg() of up to BATCH_SIZE datagrams with -b: one blocking call per receive while no timer is
+// near, otherwise a non-blocking one and a ppoll() up to the timer once the socket ran dry
+void classic_run() {
+    if (BATCH_SIZE == 1) {
+        bool backlogged = false; // the last non-blocking receive found a datagram waiting
+        int probes = 0;
+        int held = 0;            // datagrams received while total order batches waited
+        while (1) {
+            // receiving messages, without blocking while total order batches wait for the socket to run dry
+            char buffer[MAX_LENGTH + 1]; // handle_datagram() terminates it
+            struct sockaddr_in src_addr;
+            socklen_t src_len = sizeof(src_addr);
+            long long deadline = next_deadline();
+            bool timer_near = !receive_blocks(deadline);
+            bool block = !timer_near && !TOTAL_pending();
+            SYSCALLS.fetch_add(1, memory_order_relaxed);
+            ssize_t bytes_received = recvfrom(socket_fd, buffer, MAX_LENGTH, block ? 0 : MSG_DONTWAIT, (struct sockaddr *)&src_addr, &src_len);
+            if (bytes_received >= 0) {
+                handle_datagram(buffer, bytes_received, src_addr);
+            }
+            if (!block) {
+                backlogged = bytes_received >= 0;
+            }
+            if (NUM_WORKERS == 0) {
+                room_timers(0);
+            }
+            // batches wait for the next datagram only while the socket is backlogged, every 8th datagram checks
+            // whether a burst started, so sparse traffic costs no extra receive; a socket that never runs dry
+            // still gets answers every 256 datagrams
+            bool hold = bytes_received >= 0 && (backlogged || ++probes % 8 == 0) && ++held < 256;
+            if (!hold) {
+                TOTAL_flush(socket_fd);
+                held = 0;
+            }
+            flush_coalesced(socket_fd, false);
+            link_timers(socket_fd);
+            evict_idle_clients();
+            if (bytes_received < 0 && timer_near) {
+                wait_readable(deadline);
+            }
+            if (STOPPING) {
+                shutdown_server();
+            }
+        }
+    }
+
+    // batched mode: drain up to BATCH_SIZE datagrams per wakeup, then flush everything they produced
+    vector<char> buffers(BATCH_SIZE * (MAX_LENGTH + 1));
+    vector<sockaddr_in> src_addrs(BATCH_SIZE);
+    vector<iovec> iovs(BATCH_SIZE);
+    vector<mmsghdr> msgs(BATCH_SIZE);
+    while (1) {
+        for (int i = 0; i < BATCH_SIZE; i++) {
+            iovs[i].iov_base = &buffers[i * (MAX_LENGTH + 1)];
+            iovs[i].iov_len = MAX_LENGTH;
+            memset(&msgs[i], 0, sizeof(msgs[i]));
+            msgs[i].msg_hdr.msg_name = &src_addrs[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(src_addrs[i]);
+            msgs[i].msg_hdr.msg_iov = &iovs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+        long long deadline = next_deadline();
+        bool block = receive_blocks(deadline);
+        SYSCALLS.fetch_add(1, memory_order_relaxed);
+        int n = recvmmsg(socket_fd, msgs.data(), BATCH_SIZE, block ? MSG_WAITFORONE : MSG_DONTWAIT, NULL);
+        for (int i = 0; i < n; i++) {
+            handle_datagram((char *)iovs[i].iov_base, msgs[i].msg_len, src_addrs[i]);
+        }
+        if (NUM_WORKERS == 0) {
+            room_timers(0);
+        }
+        TOTAL_flush(socket_fd);
+        flush_coalesced(socket_fd, false);
+        link_timers(socket_fd);
+        evict_idle_clients();
+        flush_outbox(socket_fd);
+        if (n < 0 && !block) {
+            wait_readable(deadline);
+        }
+        if (STOPPING) {
+            shutdown_server();
+        }
+    }
+}
+
+#if HAVE_URING
+// raw syscalls, no liburing: needs provided buffer rings (5.19) and multishot recvmsg (6.0), anything older
+// or a kernel with io_uring disabled refuses here and the server runs the classic loop instead
+bool uring_start() {
+    io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    params.flags = IORING_SETUP_CQSIZE;
+    params.cq_entries = URING_ENTRIES * 8;
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &params);
+    if (fd < 0) {
+        return false;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+        close(fd);
+        return false;
+    }
+    size_t ring_size = max(params.sq_off.array + params.sq_entries * sizeof(unsigned), params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+    char *rings = (char *)mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void *sqes = mmap(NULL, params.sq_entries * sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    void *buf_ring = mmap(NULL, URING_BUFFERS * sizeof(io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (rings == MAP_FAILED || sqes == MAP_FAILED || buf_ring == MAP_FAILED) {
+        close(fd);
+        return false;
+    }
+    io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = 0;
+    if (syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        close(fd);
+        return false;
+    }
+
+    Uring *ring = new Uring();
+    ring->fd = fd;
+    ring->sq_head = (unsigned *)(rings + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(rings + params.sq_off.tail);
+    ring->sq_mask = (unsigned *)(rings + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned *)(rings + params.sq_off.array);
+    ring->sq_entries = params.sq_entries;
+    ring->sqes = (io_uring_sqe *)sqes;
+    ring->cq_head = (unsigned *)(rings + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(rings + params.cq_off.tail);
+    ring->cq_mask = (unsigned *)(rings + params.cq_off.ring_mask);
+    ring->cqes = (io_uring_cqe *)(rings + params.cq_off.cqes);
+    ring->buf_ring = (io_uring_buf_ring *)buf_ring;
+    ring->buffers.resize(URING_BUFFERS * URING_STRIDE);
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        uring_recycle(*ring, i);
+    }
+    __atomic_store_n(&ring->buf_ring->tail, ring->buf_tail, __ATOMIC_RELEASE);
+    memset(&ring->recv_msg, 0, sizeof(ring->recv_msg));
+    ring->recv_msg.msg_namelen = sizeof(sockaddr_in);
+    ring->sends.resize(URING_SENDS);
+    for (int i = URING_SENDS - 1; i >= 0; i--) {
+        ring->free_sends.push_back(i);
+    }
+
+    // a kernel without multishot recvmsg fails the receive as soon as it is submitted
+    uring_arm_receive(*ring);
+    uring_enter(*ring, false);
+    unsigned head = *ring->cq_head;
+    if (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE) && ring->cqes[head & *ring->cq_mask].res == -EINVAL) {
+        close(fd);
+        delete ring;
+        return false;
+    }
+    URING = ring;
+    URING_FD = fd;
+    return true;
+}
+
+// one io_uring_enter per round submits the sends the round produced and waits for datagrams or the next timer
+void uring_run() {
+    Uring &ring = *URING;
+    while (1) {
+        uring_reap(ring);
+        if (ring.failures >= URING_RECV_RETRIES) {
+            uring_fall_back(ring);
+        }
+        if (NUM_WORKERS == 0) {
+            room_timers(0);
+        }
+        TOTAL_flush(socket_fd);
+        flush_coalesced(socket_fd, false);
+        link_timers(socket_fd);
+        evict_idle_clients();
+        flush_outbox(socket_fd);
+        bool pending = *ring.cq_head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        if (!pending || ring.queued > 0) {
+            uring_enter(ring, !pending);
+        }
+        if (STOPPING) {
+            shutdown_server();
+        }
+    }
+}
+
+// submits the queued SQEs, and with wait blocks for a completion until next_deadline(), at most RECV_TIMEOUT_MICROS
+void uring_enter(Uring &ring, bool wait) {
+    unsigned flags = 0;
+    io_uring_getevents_arg arg;
+    __kernel_timespec timeout;
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        flags = IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        long long deadline = next_deadline();
+        if (!ring.receiving) { // backing off, the receive is re-armed by the round after rearm_at
+            deadline = deadline < 0 ? ring.rearm_at : min(deadline, ring.rearm_at);
+        }
+        long long wait_micros = receive_blocks(deadline) ? RECV_TIMEOUT_MICROS : max(0LL, deadline - now_micros());
+        timeout.tv_sec = wait_micros / 1000000;
+        timeout.tv_nsec = wait_micros % 1000000 * 1000;
+        arg.ts = (uint64_t)&timeout;
+    }
+    SYSCALLS.fetch_add(1, memory_order_relaxed);
+    int submitted = syscall(__NR_io_uring_enter, ring.fd, ring.queued, wait ? 1 : 0, flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (submitted > 0) {
+        ring.queued -= min((unsigned)submitted, ring.queued);
+    }
+}
+
+// the next free SQE, zeroed; the kernel only reads the SQ inside io_uring_enter, so publishing the tail
+// before the caller fills the entry is safe
+io_uring_sqe *uring_sqe(Uring &ring) {
+    unsigned tail = *ring.sq_tail;
+    if (tail - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries) {
+        uring_enter(ring, false);
+    }
+    unsigned index = tail & *ring.sq_mask;
+    io_uring_sqe *sqe = &ring.sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring.sq_array[index] = index;
+    __atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring.queued++;
+    return sqe;
+}
+
+// one receive SQE keeps producing a completion per datagram until the kernel runs out of buffers
+void uring_arm_receive(Uring &ring) {
+    io_uring_sqe *sqe = uring_sqe(ring);
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = socket_fd;
+    sqe->addr = (uint64_t)&ring.recv_msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = URING_RECV;
+    ring.receiving = true;
+}
+
+// handles every completion: datagrams go to handle_datagram() straight from their buffer, finished sends
+// free their slot, failed ones are dropped like a failed sendto(); a failed receive is re-armed right away
+// once, e.g. after running out of buffers in a burst, then with a doubling delay until uring_run() gives up
+void uring_reap(Uring &ring) {
+    unsigned head = *ring.cq_head;
+    unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        io_uring_cqe cqe = ring.cqes[head & *ring.cq_mask];
+        if (cqe.user_data != URING_RECV) {
+            ring.sends[cqe.user_data].datagram.data.reset();
+            ring.free_sends.push_back(cqe.user_data);
+            continue;
+        }
+        if (!(cqe.flags & IORING_CQE_F_MORE)) {
+            ring.receiving = false;
+        }
+        if (!(cqe.flags & IORING_CQE_F_BUFFER)) { // out of buffers or an error, re-armed below
+            if (cqe.res < 0) {
+                ring.failures++;
+                ring.error = -cqe.res;
+                ring.rearm_at = ring.failures == 1 ? 0 : now_micros() + (1000LL << ring.failures);
+            }
+            continue;
+        }
+        ring.failures = 0;
+        int bid = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buffer = &ring.buffers[bid * URING_STRIDE];
+        io_uring_recvmsg_out *out = (io_uring_recvmsg_out *)buffer;
+        sockaddr_in src_addr;
+        memcpy(&src_addr, buffer + sizeof(*out), sizeof(src_addr));
+        char *payload = buffer + sizeof(*out) + ring.recv_msg.msg_namelen;
+        handle_datagram(payload, min((int)out->payloadlen, MAX_LENGTH), src_addr);
+        uring_recycle(ring, bid);
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    __atomic_store_n(&ring.buf_ring->tail, ring.buf_tail, __ATOMIC_RELEASE);
+    if (!ring.receiving && ring.failures < URING_RECV_RETRIES && now_micros() >= ring.rearm_at) {
+        uring_arm_receive(ring);
+    }
+}
+
+// queues a receive buffer for the kernel, the entry's resv field is left alone since entry 0 holds the ring tail;
+// entries are indexed by hand because C++ gives the empty struct in front of the header's bufs[] a byte
+void uring_recycle(Uring &ring, int bid) {
+    io_uring_buf &buf = ((io_uring_buf *)ring.buf_ring)[ring.buf_tail & (URING_BUFFERS - 1)];
+    buf.addr = (uint64_t)&ring.buffers[bid * URING_STRIDE];
+    buf.len = URING_BUFFER_LEN;
+    buf.bid = bid;
+    ring.buf_tail++;
+}
+
+// the receive keeps failing: the sends in flight finish, the ring goes away and the classic loop takes over
+// the socket for the rest of the run
+void uring_fall_back(Uring &ring) {
+    cerr << "The uring event loop failed to receive " << ring.failures << " times in a row (" << strerror(ring.error) << "), using " << EVENT_LOOPS[0].name << endl;
+    flush_outbox(socket_fd);
+    while (ring.queued > 0 || ring.free_sends.size() < (size_t)URING_SENDS) {
+        uring_enter(ring, ring.queued == 0);
+        uring_reap(ring);
+    }
+    uring_stop();
+    URING = NULL;
+    delete &ring;
+    EVENT_LOOPS[0].start();
+    EVENT_LOOPS[0].run();
+}
+
+// requests in flight hold the socket until the ring's teardown, which the kernel finishes some time after we
+// exit, so they are cancelled here to free the port for a restart right away
+void uring_stop() {
+    if (URING_FD < 0) {
+        return;
+    }
+    io_uring_sync_cancel_reg cancel;
+    memset(&cancel, 0, sizeof(cancel));
+    cancel.fd = socket_fd;
+    cancel.flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+    cancel.timeout.tv_sec = -1;
+    cancel.timeout.tv_nsec = -1;
+    syscall(__NR_io_uring_register, URING_FD, IORING_REGISTER_SYNC_CANCEL, &cancel, 1);
+    close(URING_FD);
+    URING_FD = -1;
+}
+
+// the outbox as SENDMSG SQEs, submitted by the next uring_enter()
+void uring_send_outbox(Uring &ring) {
+    for (size_t i = 0; i < OUTBOX.size(); i++) {
+        if (ring.free_sends.empty()) { // every slot in flight, this one goes out right away
+            SYSCALLS.fetch_add(1, memory_order_relaxed);
+            sendto(socket_fd, OUTBOX[i].data->data(), OUTBOX[i].data->size(), 0, (struct sockaddr *)&OUTBOX[i].address, sizeof(OUTBOX[i].address));
+            continue;
+        }
+        int slot = ring.free_sends.back();
+        ring.free_sends.pop_back();
+        Uring::Send &send = ring.sends[slot];
+        send.datagram = move(OUTBOX[i]);
+        send.iov.iov_base = (void *)send.datagram.data->data();
+        send.iov.iov_len = send.datagram.data->size();
+        memset(&send.msg, 0, sizeof(send.msg));
+        send.msg.msg_name = &send.datagram.address;
+        send.msg.msg_namelen = sizeof(send.datagram.address);
+        send.msg.msg_iov = &send.iov;
+        send.msg.msg_iovlen = 1;
+        io_uring_sqe *sqe = uring_sqe(ring);
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = socket_fd;
+        sqe->addr = (uint64_t)&send.msg;
+        sqe->len = 1;
+        sqe->user_data = slot;
+    }
+    OUTBOX.clear();
+}
+#else
+bool uring_start() {
+    return false;
+}
+
+void uring_run() {}
+
+void uring_send_outbox(Uring &ring) {}
+
+void uring_stop() {}
+#endif
+
+long long wall_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+long long now_micros() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// every datagram to a server carries a link sequence number and the cumulative ack of the reverse direction,
+// the receiver hands payloads up in link order and NACKs gaps, the sender keeps the last LINK_WINDOW
+// datagrams to answer NACKs and retransmits whatever stays unacknowledged for LINK_RTO_MICROS
+void link_send(int fd, int server, const string &header, Content content) {
+    SENT[SOURCE_SERVER].fetch_add(1, memory_order_relaxed);
+    if (LINK_WINDOW == 0) {
+        iovec iov[3] = {{(void *)header.data(), header.size()}, {(void *)content.prefix.data(), content.prefix.size()}, {(void *)content.body.data(), content.body.size()}};
+        send_datagram(fd, iov, 3, SERVERS[server]);
+        return;
+    }
+    long long now = now_micros();
+    Link &link = *LINKS[server];
+    // the retransmit copy is the one that goes out, sent under the lock so a trim cannot free it first
+    lock_guard<mutex> guard(link.lock);
+    link.next_seq++;
+    string datagram = link_header(link, LINK_DATA, link.next_seq);
+    datagram.reserve(LINK_HEADER_LEN + header.size() + content.size());
+    datagram += header;
+    content.append_to(datagram);
+    link.ack_pending = false; // the ack rides on this datagram
+    if (link.unacked.size() == (size_t)LINK_WINDOW) {
+        link.unacked.pop_front();
+        LINK_OVERFLOWS++;
+    }
+    link.unacked.push_back({link.next_seq, move(datagram), now});
+    send_datagram(fd, link.unacked.back().datagram, SERVERS[server]);
+}
+
+void link_receive(int fd, int server, const char *buffer, size_t len) {
+    if (LINK_WINDOW == 0 || len < LINK_HEADER_LEN) {
+        if (FLAG_DEBUG) {
+            log_event(LOG_LINK_MISMATCH, server, 0, "");
+        }
+        return;
+    }
+    int type = buffer[1];
+    uint32_t seq, ack, epoch, our_epoch;
+    memcpy(&seq, buffer + 4, 4);
+    memcpy(&ack, buffer + 8, 4);
+    memcpy(&epoch, buffer + 12, 4);
+    memcpy(&our_epoch, buffer + 16, 4);
+    seq = ntohl(seq);
+    ack = ntohl(ack);
+    epoch = ntohl(epoch);
+    our_epoch = ntohl(our_epoch);
+
+    long long now = now_micros();
+    Link &link = *LINKS[server];
+    bool in_order = false;
+    vector<string> ready;  // payloads released from behind a gap, in order
+    vector<string> resend; // answers to a NACK
+    {
+        lock_guard<mutex> guard(link.lock);
+        if (our_epoch != 0 && our_epoch != LINK_EPOCH) {
+            // meant for our previous incarnation, an ACK with our epoch makes the peer start over
+            send_datagram(fd, link_header(link, LINK_ACK, 0), SERVERS[server]);
+            return;
+        } else if (epoch != link.peer_epoch) {
+            if (link.peer_epoch != 0 && seq_before(epoch, link.peer_epoch)) {
+                return; // still in flight from before the peer restarted
+            }
+            if (link.peer_epoch != 0) { // it restarted, nothing we sent or held is wanted any more
+                link.next_seq = 0;
+                link.unacked.clear();
+                LINK_RESTARTS++;
+            }
+            link.peer_epoch = epoch;
+            link.expected = 1;
+            link.early.clear();
+            link.highest = 0;
+            link.nack_sent = 0;
+            link.ack_pending = false;
+        }
+        while (!link.unacked.empty() && !seq_before(ack, link.unacked.front().seq)) {
+            link.unacked.pop_front();
+        }
+
+        if (type == LINK_DATA) {
+            if (seq_before(seq, link.expected) || link.early.count(seq) > 0) {
+                LINK_DUPLICATES++; // our ack got lost, acknowledge again
+            } else if (seq == link.expected) {
+                in_order = true;
+                link.expected++;
+                link_drain(link, ready);
+            } else {
+                if (seq_before(link.highest, link.expected)) {
+                    link.nack_sent = now - LINK_NACK_MICROS + LINK_REORDER_MICROS;
+                }
+                // anything past the window is dropped, the NACK brings it back or tells us it is gone
+                if (seq - link.expected < (uint32_t)LINK_WINDOW) {
+                    link.early.emplace(seq, string(buffer + LINK_HEADER_LEN, len - LINK_HEADER_LEN));
                 }
-                sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&CLIENTS[cur_client_idx].address, sizeof(CLIENTS[cur_client_idx].address));
+            }
+            if (seq_before(link.highest, seq)) {
+                link.highest = seq;
+            }
+            if (!link.ack_pending) {
+                link.ack_pending = true;
+                link.ack_due = now + LINK_ACK_MICROS;
+            }
+
+        } else if (type == LINK_NACK) {
+            uint32_t first_held = link.unacked.empty() ? link.next_seq + 1 : link.unacked.front().seq;
+            bool skip = false;
+            for (const char *p = buffer + LINK_HEADER_LEN; p + 4 <= buffer + len; p += 4) {
+                uint32_t missing;
+                memcpy(&missing, p, 4);
+                missing = ntohl(missing);
+                if (seq_before(missing, first_held)) {
+                    skip = true;
+                } else if (!seq_before(link.next_seq, missing)) {
+                    Unacked &u = link.unacked[missing - first_held];
+                    u.sent = now;
+                    resend.push_back(u.datagram);
+                }
+            }
+            if (skip) {
+                resend.push_back(link_header(link, LINK_SKIP, first_held));
+            }
+            LINK_RETRANSMITS += resend.size() - skip;
+
+        } else if (type == LINK_SKIP && seq_before(link.expected, seq)) {
+            // the sender no longer holds expected .. seq - 1, hand up what did arrive and move on
+            while (!link.early.empty() && seq_before(link.early.begin()->first, seq)) {
+                ready.push_back(move(link.early.begin()->second));
+                link.early.erase(link.early.begin());
+            }
+            link.expected = seq;
+            link_drain(link, ready);
+        }
+    }
+
+    if (in_order) {
+        receive_payload(server, buffer + LINK_HEADER_LEN, len - LINK_HEADER_LEN);
+    }
+    for (size_t i = 0; i < ready.size(); i++) {
+        receive_payload(server, ready[i].data(), ready[i].size());
+    }
+    for (size_t i = 0; i < resend.size(); i++) {
+        send_datagram(fd, resend[i], SERVERS[server]);
+    }
+}
+
+// moves the payloads that became consecutive with expected into ready
+void link_drain(Link &link, vector<string> &ready) {
+    while (!link.early.empty() && link.early.begin()->first == link.expected) {
+        ready.push_back(move(link.early.begin()->second));
+        link.early.erase(link.early.begin());
+        link.expected++;
+    }
+}
+
+// I/O thread: retransmits on timeout, re-NACKs open gaps and sends ACKs that found nothing to ride on
+void link_timers(int fd) {
+    if (LINK_WINDOW == 0) {
+        return;
+    }
+    long long now = now_micros();
+    if (now < LINK_NEXT_TICK) {
+        return;
+    }
+    bool busy = false;
+    for (size_t i = 0; i < LINKS.size(); i++) {
+        Link &link = *LINKS[i];
+        vector<string> out;
+        {
+            lock_guard<mutex> guard(link.lock);
+            for (size_t j = 0; j < link.unacked.size() && out.size() < LINK_RESEND_MAX; j++) {
+                Unacked &u = link.unacked[j];
+                if (now - u.sent >= LINK_RTO_MICROS) {
+                    u.sent = now;
+                    out.push_back(u.datagram);
+                }
+            }
+            LINK_RETRANSMITS += out.size();
+
+            bool gap = !seq_before(link.highest, link.expected);
+            if (gap && now - link.nack_sent >= LINK_NACK_MICROS) {
+                string nack = link_header(link, LINK_NACK, 0);
+                for (uint32_t missing = link.expected; !seq_before(link.highest, missing) && nack.size() < LINK_HEADER_LEN + 4 * LINK_NACK_MAX; missing++) {
+                    if (link.early.count(missing) == 0) {
+                        uint32_t n = htonl(missing);
+                        nack.append((const char *)&n, 4);
+                    }
+                }
+                out.push_back(nack);
+                link.nack_sent = now;
+                link.ack_pending = false;
+                LINK_NACKS++;
+            } else if (link.ack_pending && now >= link.ack_due) {
+                out.push_back(link_header(link, LINK_ACK, 0));
+                link.ack_pending = false;
+            }
+            busy = busy || !link.unacked.empty() || gap || link.ack_pending;
+        }
+        for (size_t j = 0; j < out.size(); j++) {
+            send_datagram(fd, out[j], SERVERS[i]);
+        }
+    }
+    // idle links still get a look now and then, workers may have sent since
+    LINK_NEXT_TICK = now + (busy ? LINK_TICK_MICROS : LINK_RTO_MICROS);
+}
+
+// acks what the link handed up so far, called under the link's lock
+string link_header(const Link &link, int type, uint32_t seq) {
+    char header[LINK_HEADER_LEN] = {LINK_MAGIC, (char)type, 0, 0};
+    uint32_t fields[4] = {htonl(seq), htonl(link.expected - 1), htonl(LINK_EPOCH), htonl(link.peer_epoch)};
+    memcpy(header + 4, fields, sizeof(fields));
+    return string(header, LINK_HEADER_LEN);
+}
+
+// sequence number comparison that survives wrap-around
+bool seq_before(uint32_t a, uint32_t b) {
+    return (int32_t)(a - b) < 0;
+}
+
+// case-insensitive prefix match, "/JOIN 3" is a /join
+bool command_is(string_view line, const char *name) {
+    size_t len = strlen(name);
+    return line.size() >= len && strncasecmp(line.data(), name, len) == 0;
+}
+
+// IPv4 address in the high bits, port in the low 16 bits
+uint64_t addr_key(const sockaddr_in &addr) { return (uint64_t)addr.sin_addr.s_addr << 16 | addr.sin_port; }
+
+void initialize() {
+    ROOMS.resize(max(NUM_WORKERS, 1));
+    ROOMS_SYNCING.resize(ROOMS.size());
+    ROOMS_NEXT_EXPIRY.resize(ROOMS.size());
+    ROOMS_NEXT_ANNOUNCE.resize(ROOMS.size());
+    for (size_t i = 0; i < SERVERS.size(); i++) {
+        PEER_SERVERS |= i == (size_t)self_id ? 0 : 1ULL << i;
+    }
+    ROOM_INCARNATION = (uint32_t)time(NULL) << 8 | 1; // differs across restarts of this server
+    LINK_EPOCH = (uint32_t)(wall_micros() / 1000) | 1;  // the same in milliseconds, never the 0 of an unknown peer
+
+    for (size_t i = 0; i < SERVERS.size(); i++) {
+        LINKS.push_back(new Link());
+    }
+}
 
-            } else { // if client sends a message
-                if (CLIENTS[cur_client_idx].room == 0) {
-                    string message = JOIN_WARN_MSG;
-                    sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&CLIENTS[cur_client_idx].address, sizeof(CLIENTS[cur_client_idx].address));
-                } else {
-                    string name;
-                    if (CLIENTS[cur_client_idx].nick_name.empty()) {
-                        name = string(inet_ntoa(CLIENTS[cur_client_idx].address.sin_addr)) + ":" + to_string(CLIENTS[cur_client_idx].address.sin_port);
-                    } else {
-                        name = CLIENTS[cur_client_idx].nick_name;
-                    }
-                    string str_content = "<" + name + "> " + string(buffer);
+// rooms live in the registry of the thread that owns them, so no two threads ever touch one
+int room_owner(int room) { return NUM_WORKERS > 0 ? (room - 1) % NUM_WORKERS : 0; }
+
+Room *room_find(int room) {
+    unordered_map<int, Room *> &rooms = ROOMS[room_owner(room)];
+    unordered_map<int, Room *>::iterator it = rooms.find(room);
+    return it == rooms.end() ? NULL : it->second;
+}
 
-                    if (ORDER == 0) { // Unordered
-                        string message = to_string(CLIENTS[cur_client_idx].room) + "+" + str_content;
-                        basic_multicast(socket_fd, message);
+// creates the room's state on first use, peers learn about it from the announcement room_settle() sends
+Room &room_get(int room) {
+    Room *found = room_find(room);
+    if (found != NULL) {
+        return *found;
+    }
+    Room *created = new Room();
+    created->id = room;
+    created->incarnation = ROOM_INCARNATION++;
+    created->R.assign(SERVERS.size(), 0);
+    created->fifo_holdback.resize(SERVERS.size());
+    created->clock.assign(SERVERS.size(), 0);
+    created->peers.resize(SERVERS.size());
+    created->gauges = new RoomGauges();
+    {
+        lock_guard<mutex> guard(GAUGES_LOCK);
+        GAUGES[room] = created->gauges;
+    }
+    ROOMS[room_owner(room)][room] = created;
+    return *created;
+}
 
-                    } else if (ORDER == 1) { // FIFO
-                        FIFO_multicast(socket_fd, cur_client_idx, str_content);
+void room_add(int room, const Client &client) {
+    Room &state = room_get(room);
+    Member m = {client.cid, client.address};
+    state.joining.push_back(m);
+    room_settle(state);
+    if (state.syncing == 0) {
+        room_welcome(state);
+    }
+}
 
-                    } else if (ORDER == 2) { // TOTAL
-                        TOTAL_multicast(socket_fd, cur_client_idx, str_content);
+// joiners get their +OK and deliveries once every peer routes the room's traffic here, so a member sees
+// everything posted after its +OK, or once room_timers() stops waiting for a peer that does not answer
+void room_welcome(Room &room) {
+    for (size_t i = 0; i < room.joining.size(); i++) {
+        room.members.push_back(room.joining[i]);
+        send_to_client(socket_fd, JOIN_OK_MSG + to_string(room.id), room.joining[i].address);
+    }
+    room.joining.clear();
+}
 
-                    } else if (ORDER == 3) { // CAUSAL
-                        CAUSAL_multicast(socket_fd, cur_client_idx, str_content);
-                    }
-                }
-            }
+// swap with the last member, delivery order within a room does not matter
+void room_remove(int room, int cid) {
+    Room *state = room_find(room);
+    if (state == NULL) {
+        return;
+    }
+    vector<Member> &members = state->members;
+    for (size_t i = 0; i < members.size(); i++) {
+        if (members[i].cid == cid) {
+            members[i] = members.back();
+            members.pop_back();
+            break;
+        }
+    }
+    vector<Member> &joining = state->joining;
+    for (size_t i = 0; i < joining.size(); i++) {
+        if (joining[i].cid == cid) {
+            joining.erase(joining.begin() + i);
+            break;
         }
+    }
+    room_settle(*state);
+}
+
+// end of every change to a room: announce a new incarnation or a change of occupancy, refresh the gauges
+// and reclaim the room if that was the last thing keeping it alive, the room may be gone afterwards
+void room_settle(Room &room) {
+    bool occupied = !room.members.empty() || !room.joining.empty();
+    if (occupied != room.occupied) {
+        room_occupy(room, occupied);
+    }
+    if (!room.announced || occupied != room.occupied) {
+        room.announced = true;
+        room.occupied = occupied;
+        room_announce(room, PEER_SERVERS, false);
+    }
+    update_gauges(room);
+    room_reclaim(room);
+}
 
-        // if from server: deliver the message
-        else if (source == "SERVER") {
-            if (ORDER == 0) {
-                int room = atoi(strtok(buffer, "+"));
-                char *content = strtok(NULL, "+");
-                string str_content = string(content);
-                basic_deliver(socket_fd, room, str_content);
+// peers only route the room's traffic here while we have members, so our first member starts from the
+// counters the peers answer with once they route to us, and the last one leaving drops what is held back
+void room_occupy(Room &room, bool occupied) {
+    set<int> &syncing = ROOMS_SYNCING[room_owner(room.id)];
+    room.occupancy++;
+    if (occupied) {
+        room.interest |= 1ULL << self_id;
+        room.syncing = PEER_SERVERS;
+        room.sync_started = room.sync_sent = now_micros();
+        room.R[self_id] = room.S; // our own copies were not sent here either
+        if (home_server(room.id) == self_id) {
+            room.seq_delivered = room.seq_assigned;
+        }
+        if (room.syncing != 0) {
+            syncing.insert(room.id);
+        }
+        return;
+    }
+    room.interest &= ~(1ULL << self_id);
+    room.syncing = 0;
+    syncing.erase(room.id);
+    for (size_t i = 0; i < room.fifo_holdback.size(); i++) {
+        room.fifo_holdback[i] = FifoWindow();
+    }
+    room.causal_holdback = CausalHoldback();
+    room.seq_holdback = FifoWindow();
+}
 
-            } else if (ORDER == 1) {
-                FIFO_deliver(socket_fd, sender_id, buffer);
+// occupancy + our send counters for the room, always binary since the text layouts have no room for it
+void room_announce(Room &room, uint64_t targets, bool answer) {
+    int flags = room.occupied ? ANNOUNCE_OCCUPIED : 0;
+    if (answer) {
+        flags |= ANNOUNCE_ANSWER;
+    } else if (room.syncing != 0) {
+        flags |= ANNOUNCE_SYNC;
+    }
+    Frame frame = {ROOM_ANNOUNCE, flags, room.S, room.id, {room.clock[self_id], (int)room.occupancy}, "", (int)room.incarnation, room.seq_assigned, 0};
+    string header = encode_header(frame, 0);
+    for (size_t i = 0; i < SERVERS.size(); i++) {
+        if (targets >> i & 1) {
+            send_to_server(socket_fd, i, header, {});
+        }
+    }
+}
 
-            } else if (ORDER == 2) {
-                TOTAL_deliver(socket_fd, sender_id, buffer);
+// another server's announcement, a vacant room we do not have needs no state; announcements are not ordered,
+// so one from an older incarnation is dropped and one older than the occupancy applied last only brings counters
+void room_announced(int sender_id, Frame &frame) {
+    if (sender_id == self_id || frame.clock.size() != 2) {
+        return;
+    }
+    Room *found = room_find(frame.room);
+    if (found == NULL && !(frame.proposer & ANNOUNCE_OCCUPIED)) {
+        return;
+    }
+    Room &room = found != NULL ? *found : room_get(frame.room);
+    RoomPeer &peer = room.peers[sender_id];
+    if (peer.incarnation != 0 && seq_before(frame.origin, peer.incarnation)) {
+        return;
+    }
+    uint64_t bit = 1ULL << sender_id;
+    if ((uint32_t)frame.origin != peer.incarnation || !seq_before(frame.clock[1], peer.occupancy)) {
+        peer.occupancy = frame.clock[1];
+        room.interest = frame.proposer & ANNOUNCE_OCCUPIED ? room.interest | bit : room.interest & ~bit;
+    }
+    peer.sent = frame.msg_id;
+    peer.clock = frame.clock[0];
+    peer.assigned = frame.seq;
+    bool answered = (frame.proposer & ANNOUNCE_ANSWER) && (room.syncing & bit);
+    if ((uint32_t)frame.origin != peer.incarnation) {
+        bool restarted = peer.incarnation != 0;
+        peer.incarnation = frame.origin;
+        room_adopt(room, sender_id, restarted);
+        room.announced = false; // answer, so the sender learns our counters as well
+    } else if (answered) { // nothing up to these counters was routed to us
+        room_adopt(room, sender_id, false);
+    }
+    if (answered) {
+        room.syncing &= ~bit;
+        if (room.syncing == 0) {
+            ROOMS_SYNCING[room_owner(room.id)].erase(room.id);
+            room_welcome(room);
+        }
+    }
+    if (frame.proposer & ANNOUNCE_SYNC) { // it routes to us from now on, tell it where we are
+        room_announce(room, bit, true);
+    }
+    room_settle(room);
+}
 
-            } else if (ORDER == 3) {
-                CAUSAL_deliver(socket_fd, sender_id, buffer);
-            }
+// repeats the sync requests that are still unanswered and every room's announcement, announcements travel
+// unreliably without -r, and sweeps the owner's rooms for state that waited longer than -T
+void room_timers(int owner) {
+    bool sweep = STATE_TIMEOUT_MICROS > 0 && !ROOMS[owner].empty();
+    if (ROOMS_SYNCING[owner].empty() && ROOMS[owner].empty()) {
+        return;
+    }
+    long long now = now_micros();
+    for (set<int>::iterator it = ROOMS_SYNCING[owner].begin(); it != ROOMS_SYNCING[owner].end(); it++) {
+        Room &room = *room_find(*it);
+        if (now - room.sync_sent >= ROOM_RESYNC_MICROS) {
+            room.sync_sent = now;
+            room_announce(room, room.syncing, false);
+        }
+        if (!room.joining.empty() && now - room.sync_started >= ROOM_SYNC_PATIENCE_MICROS) {
+            room_welcome(room);
+        }
+    }
+    if (now >= ROOMS_NEXT_ANNOUNCE[owner]) {
+        ROOMS_NEXT_ANNOUNCE[owner] = now + ROOM_REANNOUNCE_MICROS;
+        for (unordered_map<int, Room *>::iterator it = ROOMS[owner].begin(); it != ROOMS[owner].end(); it++) {
+            room_announce(*it->second, PEER_SERVERS, false);
         }
     }
 
-    return 0;
+    if (!sweep || now < ROOMS_NEXT_EXPIRY[owner]) {
+        return;
+    }
+    ROOMS_NEXT_EXPIRY[owner] = now + room_expiry_micros();
+    vector<int> ids; // settling may reclaim a room
+    for (unordered_map<int, Room *>::iterator it = ROOMS[owner].begin(); it != ROOMS[owner].end(); it++) {
+        ids.push_back(it->first);
+    }
+    for (size_t i = 0; i < ids.size(); i++) {
+        Room &room = *room_find(ids[i]);
+        room_expire(room, now);
+        room_settle(room);
+    }
 }
-/* =============================================== main =============================================== */
 
-bool compare_addr(sockaddr_in add1, sockaddr_in add2) { return add1.sin_port == add2.sin_port && strcmp(inet_ntoa(add1.sin_addr), inet_ntoa(add2.sin_addr)) == 0; }
+// room_expire() sweeps a quarter of -T apart, a message is dropped or forced at most that late
+long long room_expiry_micros() { return max(STATE_TIMEOUT_MICROS / 4, 10000LL); }
+
+// gives up on what waited longer than -T the way -P says: our own TOTAL messages missing proposals, held
+// TOTAL messages missing their agreement, and CAUSAL messages missing a dependency
+void room_expire(Room &room, long long now) {
+    long long cutoff = now - STATE_TIMEOUT_MICROS;
+    for (unordered_map<uint64_t, Proposal>::iterator it = room.proposals.begin(); it != room.proposals.end();) {
+        Proposal &pending = it->second;
+        if (pending.started > cutoff) {
+            it++;
+            continue;
+        }
+        uint64_t id = it->first;
+        TotalHoldback::Held *own = room.total_holdback.find(id);
+        if (EXPIRE_POLICY == EXPIRE_REQUEST && pending.attempts < STATE_RETRIES && own != NULL) {
+            pending.attempts++;
+            pending.started = now;
+            Frame frame = {NEW_MSG, self_id, 0, room.id, {}, "", self_id, (int)(uint32_t)id, own->posted};
+            basic_multicast(socket_fd, pending.participants & ~pending.proposed, encode_header(frame, own->content.size()), {"", own->content});
+            EXPIRED[EXPIRE_REQUEST]++;
+            it++;
+        } else if (EXPIRE_POLICY == EXPIRE_FORCE) { // agree on the highest proposal so far
+            TOTAL_queue(AGREEMENTS, room, pending.participants, self_id, (uint32_t)id, pending.priority, pending.proposer);
+            EXPIRED[EXPIRE_FORCE]++;
+            it = room.proposals.erase(it);
+        } else { // the participants drop their copies in turn
+            EXPIRED[EXPIRE_DROP]++;
+            it = room.proposals.erase(it);
+        }
+    }
 
-void initialize() {
-    for (int i = 0; i < NUM_OF_ROOMS; i++) {
-        vector<int> inner_R;
-        vector<unordered_map<int, string>> inner_FH;
-        vector<int> inner_CLOCK;
+    vector<uint64_t> stalled;
+    for (unordered_map<uint64_t, TotalHoldback::Held>::iterator it = room.total_holdback.messages.begin(); it != room.total_holdback.messages.end(); it++) {
+        if (!it->second.deliverable && it->second.arrived <= cutoff) {
+            stalled.push_back(it->first);
+        }
+    }
+    for (size_t i = 0; i < stalled.size(); i++) {
+        uint64_t id = stalled[i];
+        TotalHoldback::Held &held = *room.total_holdback.find(id);
+        if (EXPIRE_POLICY == EXPIRE_REQUEST && held.attempts < STATE_RETRIES) { // our proposal again, the origin answers with the agreement if it has one
+            held.attempts++;
+            held.arrived = now;
+            TOTAL_queue(PROPOSALS, room, 1ULL << (id >> 32), id >> 32, (uint32_t)id, held.priority, held.proposer);
+            EXPIRED[EXPIRE_REQUEST]++;
+        } else if (EXPIRE_POLICY == EXPIRE_FORCE) { // our own proposal becomes the agreement
+            room.A = max(room.A, held.priority);
+            room.total_holdback.agree(id, held.priority, held.proposer);
+            EXPIRED[EXPIRE_FORCE]++;
+        } else {
+            room.total_holdback.erase(id);
+            EXPIRED[EXPIRE_DROP]++;
+        }
+    }
+    TOTAL_drain(socket_fd, room);
+
+    vector<CausalHoldback::Held> expired;
+    room.causal_holdback.expire(cutoff, expired);
+    for (size_t i = 0; i < expired.size(); i++) {
+        CausalHoldback::Held &held = expired[i];
+        if (held.clock[held.sender] <= room.clock[held.sender]) { // a forced one before it covered it
+            continue;
+        } else if (EXPIRE_POLICY != EXPIRE_FORCE) {
+            EXPIRED[EXPIRE_DROP]++;
+            continue;
+        }
+        basic_deliver(socket_fd, room, move(held.content), held.posted);
+        for (size_t j = 0; j < held.clock.size(); j++) { // whatever it depended on counts as delivered
+            CAUSAL_skip(socket_fd, room, j, held.clock[j]);
+        }
+        EXPIRED[EXPIRE_FORCE]++;
+    }
+
+    long long forget = now - STATE_TIMEOUT_MICROS * (STATE_RETRIES + 1); // past the last re-request
+    while (!room.agreed_order.empty()) {
+        uint64_t id = room.agreed_order.front();
+        if (room.agreed[id].at > forget && room.agreed_order.size() <= (size_t)ROOM_STATE_CAP) {
+            break;
+        }
+        room.agreed.erase(id);
+        room.agreed_order.pop_front();
+    }
+}
+
+// takes over the send counters a peer announced: ours only move up on first contact, since our state may be
+// newer than its last announcement, but start over with the peer when it reclaimed and recreated the room
+void room_adopt(Room &room, int sender_id, bool restarted) {
+    const RoomPeer &peer = room.peers[sender_id];
+    int &delivered = room.R[sender_id];
+    if (restarted) {
+        room.fifo_holdback[sender_id] = FifoWindow();
+        delivered = peer.sent;
+    } else if (peer.sent > delivered) {
+        room.fifo_holdback[sender_id].drop(delivered + 1, peer.sent);
+        delivered = peer.sent;
+        FIFO_drain(socket_fd, room, sender_id);
+    }
+
+    if (restarted) {
+        room.clock[sender_id] = peer.clock;
+    } else {
+        CAUSAL_skip(socket_fd, room, sender_id, peer.clock);
+    }
+
+    if (sender_id != home_server(room.id)) {
+        return;
+    }
+    if (restarted) {
+        room.seq_holdback = FifoWindow();
+        room.seq_delivered = peer.assigned;
+    } else if (peer.assigned > room.seq_delivered) {
+        room.seq_holdback.drop(room.seq_delivered + 1, peer.assigned);
+        room.seq_delivered = peer.assigned;
+        SEQUENCER_drain(socket_fd, room);
+    }
+}
 
-        for (int j = 0; j < SERVERS.size(); j++) {
-            unordered_map<int, string> inner_inner_FH;
-            inner_FH.push_back(inner_inner_FH);
-            inner_R.push_back(0);
-            inner_CLOCK.push_back(0);
+// a room is dropped once no server has members in it and nothing is held back or waiting for proposals,
+// traffic still on its way finds no room and is dropped like any other for a vacant room
+void room_reclaim(Room &room) {
+    if (room.interest != 0 || room.total_holdback.size() > 0 || !room.proposals.empty()) {
+        return;
+    }
+
+    {
+        lock_guard<mutex> guard(GAUGES_LOCK);
+        GAUGES.erase(room.id);
+    }
+    ROOMS[room_owner(room.id)].erase(room.id);
+    ROOMS_RECLAIMED++;
+    delete room.gauges;
+    delete &room;
+}
+
+// the same header and content go to every targeted server, nothing is joined unless coalescing or the link layer keeps it
+void basic_multicast(int fd, uint64_t targets, const string &header, Content content) {
+    for (size_t i = 0; i < SERVERS.size(); i++) {
+        if (!(targets >> i & 1)) {
+            continue;
         }
+        send_to_server(fd, i, header, content);
 
-        // FIFO
-        S.push_back(0);
-        R.push_back(inner_R);
-        FIFO_HOLDBACK.push_back(inner_FH);
+        if (FLAG_DEBUG) {
+            log_event(LOG_SERVER_SENDS, i, 0, content);
+        }
+    }
+}
 
-        // TOTAL
-        P.push_back(0);
-        A.push_back(0);
-        vector<Message> vm;
-        TOTAL_HOLDBACK.push_back(vm);
+// borrowed content, the batched mode joins it once for the whole room
+void basic_deliver(int fd, Room &room, Content content, long long posted) {
+    record_latency(posted);
+    shared_ptr<string> joined;
+    if (BATCH_SIZE > 1 && !room.members.empty()) {
+        joined = make_shared<string>();
+        joined->reserve(content.size());
+        content.append_to(*joined);
+    }
+    fan_out(fd, room, content, joined);
+}
 
-        // CAUSAL
-        vector<Message> s;
-        CAUSAL_HOLDBACK.push_back(s);
-        CLOCKS.push_back(inner_CLOCK);
+// owned content, the batched mode takes it over without copying
+void basic_deliver(int fd, Room &room, string &&content, long long posted) {
+    record_latency(posted);
+    if (BATCH_SIZE == 1) {
+        fan_out(fd, room, {"", content}, NULL);
+        return;
     }
+    shared_ptr<const string> owned = make_shared<const string>(move(content));
+    fan_out(fd, room, {"", *owned}, owned);
 }
 
-void basic_multicast(int fd, string content) {
-    for (int i = 0; i < SERVERS.size(); i++) {
-        sendto(fd, content.c_str(), content.size(), 0, (struct sockaddr *)&SERVERS[i], sizeof(SERVERS[i]));
+// joined, when set, is content as one buffer that every queued datagram of the room shares
+void fan_out(int fd, Room &room, Content content, const shared_ptr<const string> &joined) {
+    const vector<Member> &members = room.members;
+    if (content.size() > MAX_LENGTH && !members.empty()) { // in pieces, the same ones for every member
+        string whole;
+        content.append_to(whole);
+        vector<string> pieces;
+        fragment(whole, FRAG_PIECE_MAX, pieces);
+        for (size_t i = 0; i < members.size(); i++) {
+            for (size_t j = 0; j < pieces.size(); j++) {
+                SENT[SOURCE_CLIENT].fetch_add(1, memory_order_relaxed);
+                send_datagram(fd, pieces[j], members[i].address);
+            }
+        }
+        return;
+    }
+    iovec iov[2] = {{(void *)content.prefix.data(), content.prefix.size()}, {(void *)content.body.data(), content.body.size()}};
+    for (size_t i = 0; i < members.size(); i++) {
+        SENT[SOURCE_CLIENT].fetch_add(1, memory_order_relaxed);
+        if (joined == NULL) {
+            send_datagram(fd, iov, 2, members[i].address);
+        } else {
+            OUTBOX.push_back({joined, members[i].address});
+            if (OUTBOX.size() == MAX_BATCH) {
+                flush_outbox(fd);
+            }
+        }
 
         if (FLAG_DEBUG) {
-            string prefix = timestamp_prefix();
-            cout << prefix << " Server " << i + 1 << " sends: '" << content << "'" << endl;
+            log_event(LOG_DELIVERED, members[i].cid, room.id, content);
         }
     }
 }
 
-void basic_deliver(int fd, int room, string content) {
-    for (int i = 0; i < CLIENTS.size(); i++) {
-        if (CLIENTS[i].room == room) {
-            sendto(fd, content.c_str(), content.size(), 0, (struct sockaddr *)&CLIENTS[i].address, sizeof(CLIENTS[i].address));
+void send_to_client(int fd, const string &data, const sockaddr_in &addr) {
+    SENT[SOURCE_CLIENT].fetch_add(1, memory_order_relaxed);
+    send_datagram(fd, data, addr);
+}
+
+// the origin stamps posted with its wall clock, so across hosts this includes their clock offset
+void record_latency(long long posted) {
+    if (posted == 0) {
+        return;
+    }
+    long long latency = max(0LL, wall_micros() - posted);
+    int bucket = min(LATENCY_BUCKETS - 1, 64 - __builtin_clzll(latency | 1));
+    LATENCY[bucket].fetch_add(1, memory_order_relaxed);
+    LATENCY_SUM.fetch_add(latency, memory_order_relaxed);
+}
+
+// called by the owner of the room, the sizes are only read elsewhere
+void update_gauges(Room &room) {
+    RoomGauges &gauges = *room.gauges;
+    int fifo = 0;
+    for (size_t i = 0; i < room.fifo_holdback.size(); i++) {
+        fifo += room.fifo_holdback[i].count;
+    }
+    gauges.fifo.store(fifo, memory_order_relaxed);
+    gauges.total.store(room.total_holdback.size(), memory_order_relaxed);
+    gauges.causal.store(room.causal_holdback.size(), memory_order_relaxed);
+    gauges.sequencer.store(room.seq_holdback.count, memory_order_relaxed);
+    gauges.proposals.store(room.proposals.size(), memory_order_relaxed);
+    int held = fifo + room.total_holdback.size() + room.causal_holdback.size() + room.seq_holdback.count;
+    HELD.fetch_add(held - room.held, memory_order_relaxed);
+    room.held = held;
+}
+
+// one-line JSON reply to /stats, live rooms with empty holdbacks are only counted, percentiles are bucket upper bounds
+string stats_snapshot() {
+    string out = "{\"server\":" + to_string(self_id + 1);
+    out += ",\"received\":{\"client\":" + to_string(RECEIVED[SOURCE_CLIENT].load(memory_order_relaxed)) + ",\"server\":" + to_string(RECEIVED[SOURCE_SERVER].load(memory_order_relaxed)) +
+           ",\"unknown\":" + to_string(RECEIVED[SOURCE_UNKNOWN].load(memory_order_relaxed)) + "},\"malformed\":" + to_string(MALFORMED.load(memory_order_relaxed));
+    out += ",\"sent\":{\"client\":" + to_string(SENT[SOURCE_CLIENT].load(memory_order_relaxed)) + ",\"server\":" + to_string(SENT[SOURCE_SERVER].load(memory_order_relaxed)) + "}";
+    out += ",\"clients\":" + to_string(CLIENTS.count) + ",\"evicted\":" + to_string(CLIENTS_EVICTED.load(memory_order_relaxed));
+    out += ",\"throttled\":{\"client\":" + to_string(THROTTLED[0].load(memory_order_relaxed)) + ",\"room\":" + to_string(THROTTLED[1].load(memory_order_relaxed)) +
+           "},\"shed\":" + to_string(SHED.load(memory_order_relaxed)) + ",\"held\":" + to_string(HELD.load(memory_order_relaxed)) +
+           ",\"beyond_window\":" + to_string(FIFO_BEYOND_WINDOW.load(memory_order_relaxed));
+    out += ",\"expired\":{\"dropped\":" + to_string(EXPIRED[EXPIRE_DROP].load(memory_order_relaxed)) + ",\"forced\":" + to_string(EXPIRED[EXPIRE_FORCE].load(memory_order_relaxed)) +
+           ",\"requested\":" + to_string(EXPIRED[EXPIRE_REQUEST].load(memory_order_relaxed)) + ",\"capped\":" + to_string(CAPPED.load(memory_order_relaxed)) + "}";
+    out += ",\"posted\":" + to_string(POSTED.load(memory_order_relaxed));
+#ifdef COUNT_ALLOCATIONS
+    out += ",\"allocations\":" + to_string(ALLOCATIONS.load(memory_order_relaxed));
+#endif
+    out += ",\"fragments\":{\"sent\":" + to_string(FRAGMENTS_SENT.load(memory_order_relaxed)) + ",\"reassembled\":" + to_string(REASSEMBLED.load(memory_order_relaxed)) +
+           ",\"expired\":" + to_string(REASSEMBLY_DROPS[0].load(memory_order_relaxed)) + ",\"refused\":" + to_string(REASSEMBLY_DROPS[1].load(memory_order_relaxed)) + "}";
+    out += ",\"total_batches\":{\"frames\":" + to_string(TOTAL_FRAMES.load(memory_order_relaxed)) + ",\"entries\":" + to_string(TOTAL_ENTRIES.load(memory_order_relaxed)) + "}";
+    out += ",\"event_loop\":\"" + string(URING != NULL ? "uring" : "classic") + "\",\"syscalls\":" + to_string(SYSCALLS.load(memory_order_relaxed));
+
+    lock_guard<mutex> guard(GAUGES_LOCK);
+    out += ",\"live_rooms\":" + to_string(GAUGES.size()) + ",\"reclaimed_rooms\":" + to_string(ROOMS_RECLAIMED.load(memory_order_relaxed)) +
+           ",\"vacant_drops\":" + to_string(VACANT_DROPS.load(memory_order_relaxed));
+    out += ",\"rooms\":{";
+    bool first = true;
+    for (map<int, RoomGauges *>::iterator it = GAUGES.begin(); it != GAUGES.end(); it++) {
+        RoomGauges &gauges = *it->second;
+        int values[] = {gauges.fifo, gauges.total, gauges.causal, gauges.sequencer, gauges.proposals};
+        if (values[0] + values[1] + values[2] + values[3] + values[4] == 0) {
+            continue;
+        }
+        out += first ? "" : ",";
+        out += "\"" + to_string(it->first) + "\":{\"fifo\":" + to_string(values[0]) + ",\"total\":" + to_string(values[1]) + ",\"causal\":" + to_string(values[2]) +
+               ",\"sequencer\":" + to_string(values[3]) + ",\"proposals\":" + to_string(values[4]) + "}";
+        first = false;
+    }
+    out += "}";
 
-            if (FLAG_DEBUG) {
-                string prefix = timestamp_prefix();
-                cout << prefix << " Delivered '" << content << "' to Client " << CLIENTS[i].cid << " at room #" << CLIENTS[i].room << endl;
+    long counts[LATENCY_BUCKETS];
+    long total = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        counts[i] = LATENCY[i].load(memory_order_relaxed);
+        total += counts[i];
+    }
+    out += ",\"latency_us\":{\"count\":" + to_string(total);
+    if (total > 0) {
+        out += ",\"mean\":" + to_string(LATENCY_SUM.load(memory_order_relaxed) / total);
+        const double QUANTILES[] = {0.5, 0.99, 0.999};
+        const char *NAMES[] = {"p50", "p99", "p999"};
+        for (int q = 0; q < 3; q++) {
+            long seen = 0;
+            int bucket = 0;
+            while (bucket < LATENCY_BUCKETS - 1 && (seen += counts[bucket]) < QUANTILES[q] * total) {
+                bucket++;
             }
+            out += ",\"" + string(NAMES[q]) + "\":" + to_string(1LL << bucket);
         }
     }
+    out += "}}";
+    return out;
 }
 
 // FIFO ordering, msg_id + room + content
-void FIFO_multicast(int socket_fd, int cur_client_idx, string str_content) {
-    int group_id = CLIENTS[cur_client_idx].room - 1;
-    S[group_id]++;
-    string message = to_string(S[group_id]) + "+" + to_string(CLIENTS[cur_client_idx].room) + "+" + str_content;
-    basic_multicast(socket_fd, message);
-}
-
-void FIFO_deliver(int socket_fd, int sender_id, char *buffer) {
-    int msg_id = atoi(strtok(buffer, "+"));
-    int room = atoi(strtok(NULL, "+"));
-    char *content = strtok(NULL, "+");
-    string str_content = string(content);
-    int group_id = room - 1;
-
-    FIFO_HOLDBACK[group_id][sender_id][msg_id] = str_content;
-
-    int next_id = R[group_id][sender_id] + 1;
-    while (FIFO_HOLDBACK[group_id][sender_id].find(next_id) != FIFO_HOLDBACK[group_id][sender_id].end()) {
-        string msg = FIFO_HOLDBACK[group_id][sender_id][next_id];
-        basic_deliver(socket_fd, room, msg);
-        FIFO_HOLDBACK[group_id][sender_id].erase(next_id);
-        R[group_id][sender_id]++;
-        next_id = R[group_id][sender_id] + 1;
-    }
-}
-
-// TOTAL ordering, state + proposer + msg_id + room + content
-void TOTAL_multicast(int socket_fd, int cur_client_idx, string str_content) {
-    string message = to_string(NEW_MSG) + "+" + to_string(self_id) + "+0+" + to_string(CLIENTS[cur_client_idx].room) + "+" + str_content;
-    basic_multicast(socket_fd, message);
-}
-
-void TOTAL_deliver(int socket_fd, int sender_id, char *buffer) {
-    int state = atoi(strtok(buffer, "+"));
-    int proposer = atoi(strtok(NULL, "+"));
-    int msg_id = atoi(strtok(NULL, "+"));
-    int room = atoi(strtok(NULL, "+"));
-    char *content = strtok(NULL, "+");
-    string str_content = string(content);
-    int group_id = room - 1;
-    string message;
-
-    if (state == NEW_MSG) { // first step, receive new message
-        P[group_id] = max(P[group_id], A[group_id]) + 1;
-        Message m = {P[group_id], 0, false, {}, str_content};
-        TOTAL_HOLDBACK[group_id].push_back(m);
-        sort(TOTAL_HOLDBACK[group_id].begin(), TOTAL_HOLDBACK[group_id].end(), Comparator());
-        message = to_string(PROPOSAL) + "+" + to_string(self_id) + "+" + to_string(P[group_id]) + "+" + to_string(room) + "+" + str_content;
-        sendto(socket_fd, message.c_str(), message.size(), 0, (struct sockaddr *)&SERVERS[sender_id], sizeof(SERVERS[sender_id]));
-
-    } else if (state == PROPOSAL) { // receive proposal response
-        // keep tracking the proposals for each message sent out
-        if (PROPOSALS.find(str_content) == PROPOSALS.end()) { // not found, create a new one
-            vector<Message> mv;
-            PROPOSALS[str_content] = mv;
-        }
-        Message m = {msg_id, proposer, false, {}, str_content};
-        PROPOSALS[str_content].push_back(m);
-
-        if (PROPOSALS[str_content].size() == SERVERS.size()) { // got all proposals
-            sort(PROPOSALS[str_content].begin(), PROPOSALS[str_content].end(), Comparator2());
-            int T_max = PROPOSALS[str_content].begin()->msg_id;
-            int ID_max = PROPOSALS[str_content].begin()->sender_id;
-            message = to_string(AGREEMENT) + "+" + to_string(ID_max) + "+" + to_string(T_max) + "+" + to_string(room) + "+" + content;
-            basic_multicast(socket_fd, message);
-            PROPOSALS.erase(str_content);
-        }
-
-    } else { // receive final agreement and deliver
-        Message m = {msg_id, proposer, true, {}, str_content};
-        for (int i = 0; i < TOTAL_HOLDBACK[group_id].size(); i++) {
-            if (TOTAL_HOLDBACK[group_id][i].content == str_content) {
-                TOTAL_HOLDBACK[group_id][i] = m;
-            }
-        }
-        sort(TOTAL_HOLDBACK[group_id].begin(), TOTAL_HOLDBACK[group_id].end(), Comparator());
-        A[group_id] = max(A[group_id], msg_id);
-        // pop and deliver all deliverable messages
-        while (TOTAL_HOLDBACK[group_id].begin()->deliverable) {
-            if (TOTAL_HOLDBACK[group_id].size() > 0){
-                string msg_to_deliver = TOTAL_HOLDBACK[group_id].begin()->content;
-                basic_deliver(socket_fd, room, msg_to_deliver);
-                TOTAL_HOLDBACK[group_id].erase(TOTAL_HOLDBACK[group_id].begin());
-            }else{
-                break;
+void FIFO_multicast(int socket_fd, Room &room, Content content, long long posted) {
+    room.S++;
+    Frame frame = {0, 0, room.S, room.id, {}, "", 0, 0, posted};
+    basic_multicast(socket_fd, room.interest, encode_header(frame, content.size()), content);
+}
+
+void FIFO_deliver(int socket_fd, int sender_id, Room &room, Frame &frame) {
+    int msg_id = frame.msg_id;
+    FifoWindow &window = room.fifo_holdback[sender_id];
+    int &delivered = room.R[sender_id];
+
+    if (msg_id <= delivered) { // duplicate
+        return;
+    } else if (msg_id > delivered + FIFO_WINDOW) {
+        FIFO_BEYOND_WINDOW++;
+        if (FLAG_DEBUG) {
+            log_event(LOG_FIFO_BEYOND, sender_id, room.id, to_string(msg_id));
+        }
+        return;
+    } else if (msg_id != delivered + 1) {
+        window.put(msg_id, FIFO_WINDOW, move(frame.content), frame.posted);
+        return;
+    }
+
+    basic_deliver(socket_fd, room, move(frame.content), frame.posted);
+    delivered++;
+    FIFO_drain(socket_fd, room, sender_id);
+}
+
+// delivers the held messages that became consecutive with what was delivered from the sender
+void FIFO_drain(int socket_fd, Room &room, int sender_id) {
+    int &delivered = room.R[sender_id];
+    string msg;
+    long long posted;
+    while (room.fifo_holdback[sender_id].take(delivered + 1, msg, posted)) {
+        basic_deliver(socket_fd, room, move(msg), posted);
+        delivered++;
+    }
+}
+
+// TOTAL ordering, state + proposer + msg_id + origin + seq + room + content
+// the servers a message goes to are fixed when it is sent, only they propose and hear the agreement
+void TOTAL_multicast(int socket_fd, Room &room, Content content, long long posted) {
+    if (room.proposals.size() >= (size_t)ROOM_STATE_CAP) {
+        CAPPED++;
+        return;
+    }
+    room.total_seq++;
+    uint64_t targets = room.interest | 1ULL << self_id;
+    Proposal pending = {0, 0, targets, 0, now_micros(), 0};
+    room.proposals[message_id(self_id, room.total_seq)] = pending;
+    Frame frame = {NEW_MSG, self_id, 0, room.id, {}, "", self_id, room.total_seq, posted};
+    basic_multicast(socket_fd, targets, encode_header(frame, content.size()), content);
+}
+
+void TOTAL_deliver(int socket_fd, int sender_id, Room &room, Frame &frame) {
+    uint64_t id = message_id(frame.origin, frame.seq);
+
+    if (frame.state == NEW_MSG) { // first step, hold back and propose a priority
+        TotalHoldback::Held *held = room.total_holdback.find(id);
+        if (held != NULL || room.agreed.count(id)) { // asked again, our proposal may have been lost
+            if (held != NULL && !held->deliverable) {
+                TOTAL_queue(PROPOSALS, room, 1ULL << sender_id, frame.origin, frame.seq, held->priority, held->proposer);
             }
-            sort(TOTAL_HOLDBACK[group_id].begin(), TOTAL_HOLDBACK[group_id].end(), Comparator());
+            return;
+        } else if (room.total_holdback.size() >= (size_t)ROOM_STATE_CAP) { // the origin times out on us
+            CAPPED++;
+            return;
+        }
+        room.P = max(room.P, room.A) + 1;
+        room.total_holdback.insert(id, room.P, self_id, move(frame.content), frame.posted, now_micros());
+        TOTAL_queue(PROPOSALS, room, 1ULL << sender_id, frame.origin, frame.seq, room.P, self_id);
+
+    } else if (frame.state == PROPOSAL) { // receive proposal response
+        TOTAL_propose(sender_id, room, frame.origin, frame.seq, frame.msg_id, frame.proposer);
+
+    } else if (frame.state == PROPOSALS) {
+        for (size_t i = 0; i + 1 < frame.clock.size(); i += 2) {
+            TOTAL_propose(sender_id, room, frame.origin, frame.clock[i], frame.clock[i + 1], frame.proposer);
         }
+
+    } else if (frame.state == AGREEMENT) { // receive final agreement and deliver
+        if (TOTAL_agree(room, frame.origin, frame.seq, frame.msg_id, frame.proposer)) {
+            TOTAL_drain(socket_fd, room);
+        }
+
+    } else if (frame.state == AGREEMENTS) { // the whole batch first, then one pass over the holdback
+        bool agreed = false;
+        for (size_t i = 0; i + 2 < frame.clock.size(); i += 3) {
+            agreed |= TOTAL_agree(room, frame.origin, frame.clock[i], frame.clock[i + 1], frame.clock[i + 2]);
+        }
+        if (agreed) {
+            TOTAL_drain(socket_fd, room);
+        }
+    }
+}
+
+// one server's proposal for one of our messages, the agreement goes out once every participant proposed
+void TOTAL_propose(int sender_id, Room &room, int origin, int seq, int priority, int proposer) {
+    uint64_t id = message_id(origin, seq);
+    unordered_map<uint64_t, Proposal>::iterator it = room.proposals.find(id);
+    if (it == room.proposals.end()) { // a participant still waiting for an agreement we sent
+        unordered_map<uint64_t, Agreed>::iterator agreed = room.agreed.find(id);
+        if (agreed != room.agreed.end() && sender_id != self_id) {
+            TOTAL_queue(AGREEMENTS, room, 1ULL << sender_id, origin, seq, agreed->second.priority, agreed->second.proposer);
+        }
+        return;
+    }
+    Proposal &best = it->second;
+    uint64_t bit = 1ULL << sender_id;
+    if (!(best.participants & bit) || (best.proposed & bit)) {
+        return;
+    }
+    if (make_pair(priority, proposer) > make_pair(best.priority, best.proposer)) {
+        best.priority = priority;
+        best.proposer = proposer;
+    }
+    best.proposed |= bit;
+
+    if (best.proposed == best.participants) { // got all proposals
+        TOTAL_queue(AGREEMENTS, room, best.participants, origin, seq, best.priority, best.proposer);
+        room.proposals.erase(it);
+    }
+}
+
+// false if the message is not held here or was agreed on already
+bool TOTAL_agree(Room &room, int origin, int seq, int priority, int proposer) {
+    uint64_t id = message_id(origin, seq);
+    if (STATE_TIMEOUT_MICROS > 0 && !room.agreed.count(id)) {
+        room.agreed[id] = {priority, proposer, now_micros()};
+        room.agreed_order.push_back(id);
+    }
+    if (!room.total_holdback.agree(id, priority, proposer)) {
+        return false;
+    }
+    room.A = max(room.A, priority);
+    return true;
+}
+
+// proposals and agreements wait for the rest of what the thread has to do, so a busy room answers many
+// messages in one frame while a quiet one adds no delay
+void TOTAL_queue(int state, Room &room, uint64_t targets, int origin, int seq, int priority, int proposer) {
+    TotalBatch *batch = NULL;
+    for (size_t i = 0; i < TOTAL_BATCHES.size() && batch == NULL; i++) {
+        TotalBatch &b = TOTAL_BATCHES[i];
+        if (b.state == state && b.room == room.id && b.origin == origin && b.targets == targets) {
+            batch = &b;
+        }
+    }
+    if (batch == NULL) {
+        TOTAL_BATCHES.push_back({state, room.id, origin, targets, {}});
+        batch = &TOTAL_BATCHES.back();
+    }
+    batch->entries.push_back(seq);
+    batch->entries.push_back(priority);
+    if (state == AGREEMENTS) {
+        batch->entries.push_back(proposer);
+    }
+    if (batch->entries.size() >= TOTAL_BATCH_MAX * (state == AGREEMENTS ? 3 : 2)) {
+        TOTAL_send(socket_fd, *batch);
+    }
+}
+
+// a batch of one goes out as a plain PROPOSAL or AGREEMENT
+void TOTAL_send(int socket_fd, TotalBatch &batch) {
+    bool agreements = batch.state == AGREEMENTS;
+    int count = batch.entries.size() / (agreements ? 3 : 2);
+    if (count == 0) {
+        return;
+    }
+    Frame frame;
+    if (count > 1) {
+        frame = {batch.state, self_id, 0, batch.room, batch.entries, "", batch.origin, 0, 0};
+    } else if (agreements) {
+        frame = {AGREEMENT, batch.entries[2], batch.entries[1], batch.room, {}, "", batch.origin, batch.entries[0], 0};
+    } else {
+        frame = {PROPOSAL, self_id, batch.entries[1], batch.room, {}, "", batch.origin, batch.entries[0], 0};
+    }
+    basic_multicast(socket_fd, batch.targets, encode_header(frame, 0), {});
+    batch.entries.clear();
+    TOTAL_FRAMES++;
+    TOTAL_ENTRIES += count;
+}
+
+bool TOTAL_pending() {
+    for (size_t i = 0; i < TOTAL_BATCHES.size(); i++) {
+        if (!TOTAL_BATCHES[i].entries.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void TOTAL_flush(int socket_fd) {
+    for (size_t i = 0; i < TOTAL_BATCHES.size(); i++) {
+        TOTAL_send(socket_fd, TOTAL_BATCHES[i]);
+    }
+    if (TOTAL_BATCHES.size() > 64) { // kept for their buffers, unless rooms come and go
+        TOTAL_BATCHES.clear();
     }
 }
 
+// pop and deliver all deliverable messages
+void TOTAL_drain(int socket_fd, Room &room) {
+    while (room.total_holdback.front_deliverable()) {
+        TotalHoldback::Held held = room.total_holdback.pop_front();
+        basic_deliver(socket_fd, room, move(held.content), held.posted);
+    }
+}
 
 // CAUSAL ordering, clock + msg_id + room + content
-void CAUSAL_multicast(int socket_fd, int cur_client_idx, string str_content) {
-    int group_id = CLIENTS[cur_client_idx].room - 1;
-    CLOCKS[group_id][self_id]++;
-    string str_clocks = clock_to_string(group_id);
-    string message = str_clocks + "+" + to_string(self_id) + "+" + to_string(CLIENTS[cur_client_idx].room) + "+" + str_content;
-    basic_multicast(socket_fd, message);
-}
-
-void CAUSAL_deliver(int socket_fd, int sender_id, char *buffer) {
-    char *clock = strtok(buffer, "+");
-    int msg_id = atoi(strtok(NULL, "+"));
-    int room = atoi(strtok(NULL, "+"));
-    char *content = strtok(NULL, "+");
-    string str_content = string(content);
-    int group_id = room - 1;
-    if (sender_id == self_id) {
-        basic_deliver(socket_fd, room, str_content);
+void CAUSAL_multicast(int socket_fd, Room &room, Content content, long long posted) {
+    room.clock[self_id]++;
+    Frame frame = {0, 0, self_id, room.id, room.clock, "", 0, 0, posted};
+    basic_multicast(socket_fd, room.interest & PEER_SERVERS, encode_header(frame, content.size()), content);
+    basic_deliver(socket_fd, room, content, posted); // own messages are delivered in send order right away
+}
+
+void CAUSAL_deliver(int socket_fd, int sender_id, Room &room, Frame &frame) {
+    if (frame.clock.size() != room.clock.size()) {
+        return;
+    }
+    if (sender_id == self_id) { // already delivered by CAUSAL_multicast
+        return;
+    }
+    vector<CausalHoldback::Held> ready;
+    ready.push_back({sender_id, move(frame.clock), move(frame.content), frame.posted, now_micros()});
+    CAUSAL_release(socket_fd, room, ready);
+}
+
+// deliver whatever is ready, each delivery only revisits the messages parked on it
+void CAUSAL_release(int socket_fd, Room &room, vector<CausalHoldback::Held> &ready) {
+    vector<int> &delivered = room.clock;
+    while (!ready.empty()) {
+        CausalHoldback::Held held = move(ready.back());
+        ready.pop_back();
+        uint64_t dependency;
+        if (held.clock[held.sender] <= delivered[held.sender]) { // duplicate
+            continue;
+        } else if (causal_dependency(held.clock, held.sender, delivered, dependency)) {
+            if (room.causal_holdback.size() >= (size_t)ROOM_STATE_CAP) {
+                CAPPED++;
+            } else {
+                room.causal_holdback.park(dependency, move(held));
+            }
+            continue;
+        }
+        basic_deliver(socket_fd, room, move(held.content), held.posted);
+        delivered[held.sender]++;
+        room.causal_holdback.wake(message_id(held.sender, delivered[held.sender]), ready);
+    }
+}
+
+// treats everything from the sender up to seq as delivered, releasing what waited on it
+void CAUSAL_skip(int socket_fd, Room &room, int sender, int seq) {
+    if (seq <= room.clock[sender]) {
+        return;
+    }
+    vector<CausalHoldback::Held> ready;
+    for (int i = room.clock[sender] + 1; i <= seq; i++) {
+        room.causal_holdback.wake(message_id(sender, i), ready);
+    }
+    room.clock[sender] = seq;
+    CAUSAL_release(socket_fd, room, ready);
+}
+
+// first (sender, seq) that has to be delivered before a message with this clock, false if there is none
+bool causal_dependency(const vector<int> &clock, int sender, const vector<int> &delivered, uint64_t &dependency) {
+    if (clock[sender] > delivered[sender] + 1) {
+        dependency = message_id(sender, clock[sender] - 1);
+        return true;
+    }
+    for (size_t i = 0; i < clock.size(); i++) {
+        if (i != (size_t)sender && clock[i] > delivered[i]) {
+            dependency = message_id(i, clock[i]);
+            return true;
+        }
+    }
+    return false;
+}
+
+// SEQUENCER ordering, state + msg_id + room + content
+void SEQUENCER_multicast(int socket_fd, Room &room, Content content, long long posted) {
+    Frame frame = {SEQ_REQUEST, self_id, 0, room.id, {}, "", 0, 0, posted};
+    int home = home_server(room.id);
+    if (home == self_id) { // skip the hop to ourselves
+        SEQUENCER_stamp(socket_fd, room, frame, content);
     } else {
-        Message m1 = {msg_id, sender_id, false, {}, ""};
-        char *c_unit = strtok(clock, ",");
-        m1.clock.push_back(atoi(c_unit));
-        while ((c_unit = strtok(NULL, ",")) != NULL) {
-            m1.clock.push_back(atoi(c_unit));
+        send_to_server(socket_fd, home, encode_header(frame, content.size()), content);
+    }
+}
+
+void SEQUENCER_deliver(int socket_fd, int sender_id, Room &room, Frame &frame) {
+    if (frame.state == SEQ_REQUEST) { // we are the home server, stamp and multicast
+        if (home_server(room.id) == self_id) {
+            SEQUENCER_stamp(socket_fd, room, frame, {"", frame.content});
         }
-        CAUSAL_HOLDBACK[group_id].push_back(m1);
+        return;
     }
 
-    while (true) {
-        bool progress = false;
-        for (int i = 0; i < CAUSAL_HOLDBACK[group_id].size(); i++) {
-            Message m2 = CAUSAL_HOLDBACK[group_id][i];
-            bool seen_all = true;
-            for (int i = 0; i < CLOCKS[group_id].size(); i++) {
-                if (m2.clock[i] > CLOCKS[group_id][i] && i != sender_id) {
-                    seen_all = false;
+    // SEQ_ORDER: deliver in sequence number order, the home server is the only sender
+    int &delivered = room.seq_delivered;
+    if (frame.msg_id <= delivered) {
+        return;
+    } else if (frame.msg_id > delivered + FIFO_WINDOW) {
+        FIFO_BEYOND_WINDOW++;
+        return;
+    } else if (frame.msg_id != delivered + 1) {
+        room.seq_holdback.put(frame.msg_id, FIFO_WINDOW, move(frame.content), frame.posted);
+        return;
+    }
+    basic_deliver(socket_fd, room, move(frame.content), frame.posted);
+    delivered++;
+    SEQUENCER_drain(socket_fd, room);
+}
+
+void SEQUENCER_drain(int socket_fd, Room &room) {
+    int &delivered = room.seq_delivered;
+    string msg;
+    long long posted;
+    while (room.seq_holdback.take(delivered + 1, msg, posted)) {
+        basic_deliver(socket_fd, room, move(msg), posted);
+        delivered++;
+    }
+}
+
+// home server only: hand out the room's next sequence number and multicast the message with it
+void SEQUENCER_stamp(int socket_fd, Room &room, Frame &frame, Content content) {
+    room.seq_assigned++;
+    frame.state = SEQ_ORDER;
+    frame.msg_id = room.seq_assigned;
+    basic_multicast(socket_fd, room.interest, encode_header(frame, content.size()), content);
+}
+
+// every server derives the same home for a room from the shared config
+int home_server(int room) { return (room - 1) % SERVERS.size(); }
+
+uint64_t message_id(int origin, int seq) { return (uint64_t)(uint32_t)origin << 32 | (uint32_t)seq; }
+
+// binary: version(1) state(1) nclock(2) room(4) proposer(4) msg_id(4) origin(4) seq(4) length(4) posted(8), nclock clock entries(4 each), payload
+// text:   the "+"-delimited layouts noted above each ordering, clocks as a comma list, posted is not carried,
+//         room announcements and TOTAL batches go binary in either format
+// returns everything before the payload, which is length bytes and sent after it, frame.content is not used
+string encode_header(const Frame &frame, size_t length) {
+    string out;
+    if (WIRE_FORMAT == WIRE_TEXT && frame.state != ROOM_ANNOUNCE && frame.state != PROPOSALS && frame.state != AGREEMENTS) {
+        if (ORDER == 1) {
+            out = to_string(frame.msg_id) + "+";
+        } else if (ORDER == 2) {
+            out = to_string(frame.state) + "+" + to_string(frame.proposer) + "+" + to_string(frame.msg_id) + "+" + to_string(frame.origin) + "+" + to_string(frame.seq) + "+";
+        } else if (ORDER == 4) {
+            out = to_string(frame.state) + "+" + to_string(frame.msg_id) + "+";
+        } else if (ORDER == 3) {
+            for (size_t i = 0; i < frame.clock.size(); i++) {
+                if (i != 0) {
+                    out += ",";
                 }
+                out += to_string(frame.clock[i]);
             }
-            if (m2.clock[sender_id] == CLOCKS[group_id][sender_id] + 1 && seen_all) {
-                basic_deliver(socket_fd, room, str_content);
-                CLOCKS[group_id][sender_id]++;
-                CAUSAL_HOLDBACK[group_id].erase(CAUSAL_HOLDBACK[group_id].begin() + i);
-                progress = true;
+            out += "+" + to_string(frame.msg_id) + "+";
+        }
+        out += to_string(frame.room) + "+";
+        return out;
+    }
+
+    uint32_t fields[WIRE_FIELDS] = {(uint32_t)frame.room, (uint32_t)frame.proposer, (uint32_t)frame.msg_id, (uint32_t)frame.origin, (uint32_t)frame.seq, (uint32_t)length};
+    out.resize(WIRE_HEADER_LEN + 4 * frame.clock.size());
+    char *p = &out[0];
+    p[0] = WIRE_VERSION;
+    p[1] = frame.state;
+    uint16_t nclock = htons(frame.clock.size());
+    memcpy(p + 2, &nclock, 2);
+    p += 4;
+    for (int i = 0; i < WIRE_FIELDS; i++, p += 4) {
+        uint32_t v = htonl(fields[i]);
+        memcpy(p, &v, 4);
+    }
+    uint32_t posted[2] = {htonl((uint64_t)frame.posted >> 32), htonl((uint32_t)frame.posted)};
+    memcpy(p, posted, 8);
+    p += 8;
+    for (size_t i = 0; i < frame.clock.size(); i++, p += 4) {
+        uint32_t v = htonl(frame.clock[i]);
+        memcpy(p, &v, 4);
+    }
+    return out;
+}
+
+// accepts either format, text frames always start with a digit
+bool decode_frame(const char *buffer, size_t len, Frame &frame) {
+    frame = {0, 0, 0, 0, {}, "", 0, 0, 0};
+    if (len > 0 && buffer[0] == WIRE_VERSION) {
+        if (len < WIRE_HEADER_LEN) {
+            return false;
+        }
+        uint16_t nclock;
+        uint32_t fields[WIRE_FIELDS];
+        memcpy(&nclock, buffer + 2, 2);
+        nclock = ntohs(nclock);
+        for (int i = 0; i < WIRE_FIELDS; i++) {
+            memcpy(&fields[i], buffer + 4 + 4 * i, 4);
+            fields[i] = ntohl(fields[i]);
+        }
+        if (len != WIRE_HEADER_LEN + 4 * (size_t)nclock + fields[WIRE_FIELDS - 1]) {
+            return false;
+        }
+        frame.state = (unsigned char)buffer[1];
+        frame.room = fields[0];
+        frame.proposer = fields[1];
+        frame.msg_id = fields[2];
+        frame.origin = fields[3];
+        frame.seq = fields[4];
+        uint32_t posted[2];
+        memcpy(posted, buffer + 4 + 4 * WIRE_FIELDS, 8);
+        frame.posted = (long long)((uint64_t)ntohl(posted[0]) << 32 | ntohl(posted[1]));
+        const char *p = buffer + WIRE_HEADER_LEN;
+        for (int i = 0; i < nclock; i++, p += 4) {
+            uint32_t v;
+            memcpy(&v, p, 4);
+            frame.clock.push_back(ntohl(v));
+        }
+        frame.content.assign(p, fields[WIRE_FIELDS - 1]);
+        return frame_ids_valid(frame);
+    }
+
+    // legacy text, everything after the last header field is content, '+' included
+    const int TEXT_FIELDS[] = {1, 2, 6, 3, 3}; // header fields before the content, per ORDER
+    int nfields = TEXT_FIELDS[ORDER];
+    vector<const char *> starts;
+    const char *p = buffer;
+    const char *end = buffer + len;
+    for (int i = 0; i < nfields; i++) {
+        starts.push_back(p);
+        p = (const char *)memchr(p, '+', end - p);
+        if (p == NULL) {
+            return false;
+        }
+        p++;
+    }
+    frame.content.assign(p, end - p);
+    frame.room = atoi(starts[nfields - 1]);
+    if (ORDER == 1) {
+        frame.msg_id = atoi(starts[0]);
+    } else if (ORDER == 2) {
+        frame.state = atoi(starts[0]);
+        frame.proposer = atoi(starts[1]);
+        frame.msg_id = atoi(starts[2]);
+        frame.origin = atoi(starts[3]);
+        frame.seq = atoi(starts[4]);
+    } else if (ORDER == 4) {
+        frame.state = atoi(starts[0]);
+        frame.msg_id = atoi(starts[1]);
+    } else if (ORDER == 3) {
+        frame.msg_id = atoi(starts[1]);
+        for (const char *c = starts[0]; c < starts[1] - 1;) {
+            frame.clock.push_back(atoi(c));
+            c = (const char *)memchr(c, ',', starts[1] - 1 - c);
+            if (c == NULL) {
+                break;
             }
+            c++;
         }
-        if (!progress) {
-            break;
+    }
+    return frame_ids_valid(frame);
+}
+
+// origin and proposer index per-server state and bitmaps, so a frame naming a server outside the config is
+// refused; a room announcement carries flags and an incarnation in those fields instead
+bool frame_ids_valid(const Frame &frame) {
+    if (frame.state == ROOM_ANNOUNCE) {
+        return true;
+    }
+    int servers = SERVERS.size();
+    if (frame.origin < 0 || frame.origin >= servers || frame.proposer < 0 || frame.proposer >= servers) {
+        return false;
+    }
+    if (ORDER == 2 && frame.state == AGREEMENTS) {
+        for (size_t i = 2; i < frame.clock.size(); i += 3) {
+            if (frame.clock[i] < 0 || frame.clock[i] >= servers) {
+                return false;
+            }
         }
     }
+    return true;
 }
 
-void signal_handler(int signal) {
+// only sets the flag, the I/O thread sees it once its wait returns with EINTR, or within RECV_TIMEOUT_MICROS
+// when the signal landed just before the wait, and calls shutdown_server()
+void signal_handler(int signal) { STOPPING = 1; }
+
+// prints the exit summary and exits, on the I/O thread between two rounds of its loop
+void shutdown_server() {
+    if (COALESCED_DATAGRAMS > 0) {
+        fprintf(stderr, "Coalesced %ld frames into %ld datagrams: %.1f frames and %.0f bytes per datagram (%.0f%% of -c %d)\n", COALESCED_FRAMES.load(), COALESCED_DATAGRAMS.load(),
+                (double)COALESCED_FRAMES / COALESCED_DATAGRAMS, (double)COALESCED_BYTES / COALESCED_DATAGRAMS, 100.0 * COALESCED_BYTES / COALESCED_DATAGRAMS / COALESCE_BYTES, COALESCE_BYTES);
+    }
+    if (LOGGER.joinable()) {
+        LOG_STOP = true;
+        LOGGER.join();
+    }
+#ifdef COUNT_ALLOCATIONS
+    if (POSTED > 0) {
+        fprintf(stderr, "Allocations: %ld for %ld chat lines posted here, %.1f per line\n", ALLOCATIONS.load(), POSTED.load(), (double)ALLOCATIONS / POSTED);
+    }
+#endif
+    if (THROTTLED[0] + THROTTLED[1] + SHED > 0) {
+        fprintf(stderr, "Refused lines: %ld by client rate, %ld by room rate, %ld shed\n", THROTTLED[0].load(), THROTTLED[1].load(), SHED.load());
+    }
+    if (FIFO_BEYOND_WINDOW > 0) {
+        fprintf(stderr, "Beyond the FIFO window: %ld messages dropped, -W is %d\n", FIFO_BEYOND_WINDOW.load(), FIFO_WINDOW);
+    }
+    if (EXPIRED[EXPIRE_DROP] + EXPIRED[EXPIRE_FORCE] + EXPIRED[EXPIRE_REQUEST] + CAPPED > 0) {
+        fprintf(stderr, "Expired state: %ld dropped, %ld forced, %ld re-requested, %ld refused over -M\n", EXPIRED[EXPIRE_DROP].load(), EXPIRED[EXPIRE_FORCE].load(), EXPIRED[EXPIRE_REQUEST].load(),
+                CAPPED.load());
+    }
+    if (TOTAL_FRAMES > 0) {
+        fprintf(stderr, "Total order batches: %ld proposals and agreements in %ld frames, %.2f per frame\n", TOTAL_ENTRIES.load(), TOTAL_FRAMES.load(),
+                (double)TOTAL_ENTRIES / TOTAL_FRAMES);
+    }
+    long received = RECEIVED[SOURCE_CLIENT] + RECEIVED[SOURCE_SERVER] + RECEIVED[SOURCE_UNKNOWN];
+    if (received > 0) {
+        fprintf(stderr, "Syscalls: %ld for %ld datagrams received, %.2f per datagram\n", SYSCALLS.load(), received, (double)SYSCALLS / received);
+    }
+    if (LINK_WINDOW > 0) {
+        fprintf(stderr, "Links: %ld retransmits, %ld NACKs, %ld duplicates, %ld overflows, %ld peer restarts\n", LINK_RETRANSMITS.load(), LINK_NACKS.load(), LINK_DUPLICATES.load(),
+                LINK_OVERFLOWS.load(), LINK_RESTARTS.load());
+    }
+    uring_stop();
     close(socket_fd);
-    exit(0);
+    // workers are still running, so skip the static destructors that would free state under them
+    fflush(stdout);
+    fflush(stderr);
+    _exit(0);
 }
 
-string clock_to_string(int group_id) {
-    string str_clocks;
-    for (int i = 0; i < CLOCKS[group_id].size(); i++) {
-        if (i != 0) {
-            str_clocks += ",";
-        }
-        str_clocks += to_string(CLOCKS[group_id][i]);
+// hot path of -v: copies the arguments into this thread's ring, formatting and writing happen in logger_loop()
+void log_event(int kind, int a, int b, Content text) {
+    if (LOG_RING == NULL) {
+        LOG_RING = new SpscQueue<LogRecord>(LOG_RING_SIZE);
+        lock_guard<mutex> guard(LOG_RINGS_LOCK);
+        LOG_RINGS.push_back(LOG_RING);
+    }
+    LogRecord *record = LOG_RING->prepare();
+    if (record == NULL) {
+        LOG_DROPPED++;
+        return;
     }
-    return str_clocks;
+    record->micros = wall_micros();
+    record->kind = kind;
+    record->a = a;
+    record->b = b;
+    size_t prefix_len = min(text.prefix.size(), sizeof(record->text));
+    size_t body_len = min(text.body.size(), sizeof(record->text) - prefix_len);
+    if (prefix_len > 0) {
+        memcpy(record->text, text.prefix.data(), prefix_len);
+    }
+    if (body_len > 0) {
+        memcpy(record->text + prefix_len, text.body.data(), body_len);
+    }
+    record->length = prefix_len + body_len;
+    LOG_RING->publish();
 }
 
-// prefix for format
-string timestamp_prefix() {
-    stringstream ss;
-    struct timeval tv;
-    gettimeofday(&tv, NULL);
-    chrono::system_clock::time_point tp = chrono::system_clock::from_time_t(tv.tv_sec);
-    time_t tt = chrono::system_clock::to_time_t(tp);
-    tm tm = *localtime(&tt);
+void log_event(int kind, int a, int b, string_view text) {
+    log_event(kind, a, b, Content{"", text});
+}
 
-    ss << put_time(&tm, "%T") << "." << setfill('0') << setw(6) << tv.tv_usec;
-    string printout = ss.str();
+// drains every thread's ring, renders the records and writes them with one call per round
+void logger_loop() {
+    string out;
+    while (true) {
+        bool stopping = LOG_STOP; // read before draining, so records logged before the stop are all written
+        vector<SpscQueue<LogRecord> *> rings;
+        {
+            lock_guard<mutex> guard(LOG_RINGS_LOCK);
+            rings = LOG_RINGS;
+        }
+        for (size_t i = 0; i < rings.size(); i++) {
+            LogRecord *record;
+            while ((record = rings[i]->peek()) != NULL) {
+                log_render(*record, out);
+                rings[i]->consume();
+            }
+        }
+        if (!out.empty()) {
+            fwrite(out.data(), 1, out.size(), stdout);
+            fflush(stdout);
+            out.clear();
+        } else if (stopping) {
+            break;
+        } else {
+            usleep(1000);
+        }
+    }
+    if (LOG_DROPPED > 0) {
+        fprintf(stderr, "Dropped %ld log records, the logger fell behind\n", LOG_DROPPED.load());
+    }
+}
 
-    if (self_id < 9) {
-        printout += " S0" + to_string(self_id + 1);
-    } else {
-        printout += " S" + to_string(self_id + 1);
+// "HH:MM:SS.uuuuuu Sxx" and the message, the HH:MM:SS part is only rebuilt when the second changes
+void log_render(const LogRecord &record, string &out) {
+    static long long cached_second = -1;
+    static char clock_text[16];
+    static char server_text[16];
+    long long second = record.micros / 1000000;
+    if (second != cached_second) {
+        time_t tt = second;
+        tm tm;
+        localtime_r(&tt, &tm);
+        strftime(clock_text, sizeof(clock_text), "%T", &tm);
+        snprintf(server_text, sizeof(server_text), " S%02d", self_id + 1);
+        cached_second = second;
     }
-    return printout;
-}
\ No newline at end of file
+    char micros[16]; // room for any int, the value is always 6 digits
+    snprintf(micros, sizeof(micros), ".%06d", (int)(record.micros % 1000000));
+    out += clock_text;
+    out += micros;
+    out += server_text;
+
+    string text(record.text, record.length);
+    if (record.kind == LOG_NEW_CLIENT) {
+        out += " New Client " + to_string(record.a) + " posts: '" + text + "'";
+    } else if (record.kind == LOG_CLIENT_POST) {
+        out += " Existing Client " + to_string(record.a) + " posts: '" + text + "' to chat room #" + to_string(record.b);
+    } else if (record.kind == LOG_MALFORMED) {
+        out += " Dropped malformed frame from Server " + to_string(record.a + 1);
+    } else if (record.kind == LOG_LINK_MISMATCH) {
+        out += " Dropped link datagram from Server " + to_string(record.a + 1) + ", run every server with the same -r";
+    } else if (record.kind == LOG_SERVER_SENDS) {
+        out += " Server " + to_string(record.a + 1) + " sends: '" + text + "'";
+    } else if (record.kind == LOG_DELIVERED) {
+        out += " Delivered '" + text + "' to Client " + to_string(record.a) + " at room #" + to_string(record.b);
+    } else if (record.kind == LOG_FIFO_BEYOND) {
+        out += " Dropped message " + text + " from Server " + to_string(record.a + 1) + " beyond the FIFO window at room #" + to_string(record.b);
+    }
+    out += '\n';
+}
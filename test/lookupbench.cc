@@ -0,0 +1,70 @@
+/* Microbenchmark for the server's AddrIndex against the compare_addr() scan it replaced. The server is
+   a single file, so it is pulled in whole with its main() renamed; see the bench-lookup target. */
+
+#define main chatserver_main
+#include "../chatserver.cc"
+#undef main
+
+#include <assert.h>
+
+#define LOOKUPS 200000
+
+bool compare_addr(sockaddr_in add1, sockaddr_in add2) { return add1.sin_port == add2.sin_port && strcmp(inet_ntoa(add1.sin_addr), inet_ntoa(add2.sin_addr)) == 0; }
+
+double elapsedNanos(struct timespec *start)
+{
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  return (end.tv_sec - start->tv_sec) * 1e9 + (end.tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+  int sizes[] = { 10, 100, 1000, 10000 };
+  for (int s = 0; s < 4; s++) {
+    int n = sizes[s];
+    std::vector<sockaddr_in> clients(n);
+    AddrIndex index;
+    for (int i = 0; i < n; i++) {
+      memset(&clients[i], 0, sizeof(sockaddr_in));
+      clients[i].sin_family = AF_INET;
+      clients[i].sin_addr.s_addr = htonl(0x7f000001);
+      clients[i].sin_port = htons(20000 + i);
+      index.put(addr_key(clients[i]), SOURCE_CLIENT, i);
+    }
+
+    /* churn: erase every third client, check the rest are still found, then put them back */
+    for (int i = 0; i < n; i += 3)
+      index.erase(addr_key(clients[i]));
+    for (int i = 0; i < n; i++) {
+      const AddrIndex::Entry *entry = index.find(addr_key(clients[i]));
+      assert((entry == NULL) == (i % 3 == 0));
+      assert(entry == NULL || entry->idx == i);
+    }
+    for (int i = 0; i < n; i += 3)
+      index.put(addr_key(clients[i]), SOURCE_CLIENT, i);
+
+    long checksum = 0;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int k = 0; k < LOOKUPS; k++)
+      checksum += index.find(addr_key(clients[(k * 7919L) % n]))->idx;
+    double indexNanos = elapsedNanos(&start) / LOOKUPS;
+
+    int scans = (n >= 1000) ? 2000 : 20000;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int k = 0; k < scans; k++) {
+      sockaddr_in &target = clients[(k * 7919L) % n];
+      for (int i = 0; i < n; i++) {
+        if (compare_addr(clients[i], target)) {
+          checksum += i;
+          break;
+        }
+      }
+    }
+    double scanNanos = elapsedNanos(&start) / scans;
+
+    printf("%5d clients: index %6.1f ns/lookup, linear scan %10.1f ns/lookup (checksum %ld)\n", n, indexNanos, scanNanos, checksum % 7);
+  }
+  return 0;
+}
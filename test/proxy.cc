@@ -2,11 +2,20 @@
 #include <stdio.h>
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <string.h>
 #include <sys/time.h>
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <time.h>
 #include <unistd.h>
+#include <math.h>
+#include <queue>
+#include <random>
+#include <string>
+#include <vector>
 
 #define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
 #define logVerbose(a...) do { if (verbose) { fprintf(stderr, a); fprintf(stderr, "\n"); } } while (0)
@@ -14,8 +23,12 @@
 #define log(a...) do { struct timeval tv; gettimeofday(&tv, NULL); fprintf(stderr, "PRX %d.%03d ", (int)tv.tv_sec, (int)(tv.tv_usec/1000)); fprintf(stderr, a); fprintf(stderr, "\n"); } while(0)
 
 #define MAX_SERVERS 10
-#define MAX_MSG_LEN 1000
-#define MAX_QUEUE_LEN 1000
+#define MAX_MSG_LEN 65535
+#define MAX_DELAY_MICROS 10000000   /* long-tail samples are capped here */
+
+#define DELAY_UNIFORM 0   /* a = max */
+#define DELAY_NORMAL 1    /* a = mean, b = standard deviation */
+#define DELAY_PARETO 2    /* a = minimum, b = shape; smaller shapes have longer tails */
 
 struct {
   in_addr_t ip;
@@ -25,15 +38,38 @@ struct {
   int proxySocket;
 } server[MAX_SERVERS];
 
-struct {
+/* What happens to packets on one directed link; -d/-l/-u/-o/-b set the defaults, -L overrides single links */
+
+struct LinkModel {
+  int delayKind;
+  double delayA, delayB;
+  double lossProbability;
+  double dupProbability;
+  double reorderProbability;     /* chance a packet is held an extra reorderMicros, so later ones overtake it */
+  long long reorderMicros;
+  long long bytesPerSecond;      /* 0 = unlimited */
+  long long busyUntil;           /* the link is serializing earlier packets until then */
+};
+
+/* Delayed packets wait in a min-heap ordered by transmit time; seq keeps equal times in arrival order */
+
+struct QueuedPacket {
+  long long xmitTime;
+  long long seq;
   int srcServerIdx;
   int dstServerIdx;
-  long long xmitTime;
-  char buffer[MAX_MSG_LEN];
-} holdbackQueue[MAX_QUEUE_LEN];
+  std::string data;
+  bool operator>(const QueuedPacket &other) const {
+    return (xmitTime != other.xmitTime) ? (xmitTime > other.xmitTime) : (seq > other.seq);
+  }
+};
+
+std::priority_queue<QueuedPacket, std::vector<QueuedPacket>, std::greater<QueuedPacket> > holdbackQueue;
+LinkModel links[MAX_SERVERS][MAX_SERVERS];
+std::mt19937_64 rng;
 
 int numServers = 0;
-int queueLength = 0;
+long long nextSeq = 0;
 bool verbose = false;
 
 int findServer(in_addr_t ip, int port, bool useBind)
@@ -46,6 +82,15 @@ int findServer(in_addr_t ip, int port, bool useBind)
   return -1;
 }
 
+char *pbuf(const char *data, int len, char *buf)
+{
+  /* Binary server frames are logged with their non-printable bytes as '.' */
+  for (int i=0; i<len; i++)
+    buf[i] = ((data[i] >= 32) && (data[i] < 127)) ? data[i] : '.';
+  buf[len] = 0;
+  return buf;
+}
+
 char *paddr(in_addr_t ip, int port, char *buf)
 {
   struct in_addr addr;
@@ -54,54 +99,199 @@ char *paddr(in_addr_t ip, int port, char *buf)
   return buf;
 }
 
+/* Queue times are monotonic, so a wall clock step does not release or stall the whole queue */
+
 long long currentTimeMicros()
 {
-  struct timeval tv;
-  gettimeofday(&tv, NULL);
-  return (tv.tv_sec*1000000LL + tv.tv_usec);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec*1000000LL + ts.tv_nsec/1000);
+}
+
+double uniform01()
+{
+  return std::uniform_real_distribution<double>(0.0, 1.0)(rng);
+}
+
+long long sampleDelay(const LinkModel &model)
+{
+  double delay = 0;
+  if (model.delayKind == DELAY_UNIFORM) {
+    delay = (model.delayA > 0) ? uniform01() * model.delayA : 0;
+  } else if (model.delayKind == DELAY_NORMAL) {
+    delay = std::normal_distribution<double>(model.delayA, model.delayB)(rng);
+  } else if (model.delayKind == DELAY_PARETO) {
+    delay = model.delayA / pow(1.0 - uniform01(), 1.0 / model.delayB);
+  }
+  if (delay < 0)
+    delay = 0;
+  if (delay > MAX_DELAY_MICROS)
+    delay = MAX_DELAY_MICROS;
+  return (long long)delay;
+}
+
+/* "uniform:MAX", "normal:MEAN:STDDEV" or "pareto:MIN:SHAPE", all in microseconds */
+
+void parseDelay(const char *spec, LinkModel &model)
+{
+  char kind[32];
+  double a = 0, b = 0;
+  int n = sscanf(spec, "%31[a-z]:%lf:%lf", kind, &a, &b);
+  if ((n >= 2) && !strcmp(kind, "uniform")) {
+    model.delayKind = DELAY_UNIFORM;
+  } else if ((n == 3) && !strcmp(kind, "normal") && (b >= 0)) {
+    model.delayKind = DELAY_NORMAL;
+  } else if ((n == 3) && !strcmp(kind, "pareto") && (a > 0) && (b > 0)) {
+    model.delayKind = DELAY_PARETO;
+  } else {
+    panic("Invalid delay distribution '%s' (uniform:MAX, normal:MEAN:STDDEV or pareto:MIN:SHAPE)", spec);
+  }
+  model.delayA = a;
+  model.delayB = b;
+}
+
+/* One -L option: "SRC-DST:key=value,..." with 1-based server numbers or '*', keys delay, loss, dup, reorder and bw */
+
+void parseLinkOverride(const char *arg)
+{
+  char spec[1000];
+  snprintf(spec, sizeof(spec), "%s", arg);
+  char *colon = strchr(spec, ':');
+  char *dash = strchr(spec, '-');
+  if (!colon || !dash || (dash > colon))
+    panic("Invalid link override '%s' (expected SRC-DST:key=value,...)", arg);
+  *colon = 0;
+  *dash = 0;
+  int src = strcmp(spec, "*") ? atoi(spec) : 0;
+  int dst = strcmp(dash+1, "*") ? atoi(dash+1) : 0;
+  if ((src < 0) || (src > numServers) || (dst < 0) || (dst > numServers))
+    panic("Invalid server number in link override '%s'", arg);
+
+  for (int i=0; i<numServers; i++) {
+    for (int j=0; j<numServers; j++) {
+      if ((src && (src != i+1)) || (dst && (dst != j+1)))
+        continue;
+      char settings[1000];
+      snprintf(settings, sizeof(settings), "%s", colon+1);
+      char *saveptr;
+      for (char *kv = strtok_r(settings, ",", &saveptr); kv; kv = strtok_r(NULL, ",", &saveptr)) {
+        char *value = strchr(kv, '=');
+        if (!value)
+          panic("Invalid setting '%s' in link override '%s'", kv, arg);
+        *value++ = 0;
+        if (!strcmp(kv, "delay"))
+          parseDelay(value, links[i][j]);
+        else if (!strcmp(kv, "loss"))
+          links[i][j].lossProbability = atof(value);
+        else if (!strcmp(kv, "dup"))
+          links[i][j].dupProbability = atof(value);
+        else if (!strcmp(kv, "reorder"))
+          links[i][j].reorderProbability = atof(value);
+        else if (!strcmp(kv, "bw"))
+          links[i][j].bytesPerSecond = atoll(value);
+        else
+          panic("Unknown setting '%s' in link override '%s'", kv, arg);
+      }
+    }
+  }
+}
+
+void queuePacket(int srcServerIdx, int dstServerIdx, const char *data, int len)
+{
+  LinkModel &model = links[srcServerIdx][dstServerIdx];
+  long long now = currentTimeMicros();
+
+  /* A bandwidth cap serializes the link: the packet leaves after everything queued before it */
+
+  long long departure = now;
+  if (model.bytesPerSecond > 0) {
+    if (model.busyUntil > departure)
+      departure = model.busyUntil;
+    departure += len * 1000000LL / model.bytesPerSecond;
+    model.busyUntil = departure;
+  }
+
+  QueuedPacket packet;
+  packet.xmitTime = departure + sampleDelay(model);
+  if ((model.reorderProbability > 0) && (uniform01() < model.reorderProbability))
+    packet.xmitTime += model.reorderMicros;
+  packet.seq = nextSeq++;
+  packet.srcServerIdx = srcServerIdx;
+  packet.dstServerIdx = dstServerIdx;
+  packet.data.assign(data, len);
+  holdbackQueue.push(packet);
 }
 
-void deliverQueuedMessage(int idx)
+void deliverQueuedMessage(const QueuedPacket &packet)
 {
   struct sockaddr_in target;
   bzero((void*)&target, sizeof(target));
   target.sin_family = AF_INET;
-  target.sin_addr.s_addr = server[holdbackQueue[idx].dstServerIdx].bindIP;
-  target.sin_port = htons(server[holdbackQueue[idx].dstServerIdx].bindPort);
+  target.sin_addr.s_addr = server[packet.dstServerIdx].bindIP;
+  target.sin_port = htons(server[packet.dstServerIdx].bindPort);
 
   char addrbuf1[200], addrbuf2[200];
-  log("SEND %s->%s '%s'", 
-    paddr(server[holdbackQueue[idx].srcServerIdx].ip, server[holdbackQueue[idx].srcServerIdx].port, addrbuf1), 
-    paddr(server[holdbackQueue[idx].dstServerIdx].bindIP, server[holdbackQueue[idx].dstServerIdx].bindPort, addrbuf2), 
-    holdbackQueue[idx].buffer
+  static char databuf[MAX_MSG_LEN+1];
+  log("SEND %s->%s '%s'",
+    paddr(server[packet.srcServerIdx].ip, server[packet.srcServerIdx].port, addrbuf1),
+    paddr(server[packet.dstServerIdx].bindIP, server[packet.dstServerIdx].bindPort, addrbuf2),
+    pbuf(packet.data.data(), packet.data.size(), databuf)
   );
 
-  int w = sendto(server[holdbackQueue[idx].srcServerIdx].proxySocket, holdbackQueue[idx].buffer, strlen(holdbackQueue[idx].buffer), 0, (struct sockaddr*)&target, sizeof(target));
-  if (w<0)
+  int w = sendto(server[packet.srcServerIdx].proxySocket, packet.data.data(), packet.data.size(), 0, (struct sockaddr*)&target, sizeof(target));
+  if ((w<0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
     panic("sendto() failed (%s)", strerror(errno));
 }
 
 int main(int argc, char *argv[])
 {
-  long long maxDelayMicros = 5000;
-  double lossProbability = 0;
+  LinkModel defaults;
+  memset(&defaults, 0, sizeof(defaults));
+  defaults.delayKind = DELAY_UNIFORM;
+  defaults.delayA = 5000;
+  defaults.reorderMicros = -1;
+  unsigned long long seed = time(NULL);
+  std::vector<const char*> overrides;
 
   /* Parse arguments */
 
   int c;
-  while ((c = getopt(argc, argv, "d:l:v")) != -1) {
+  while ((c = getopt(argc, argv, "d:D:l:u:o:O:b:L:s:v")) != -1) {
     switch (c) {
       case 'd':
-        maxDelayMicros = atoll(optarg);
+        defaults.delayKind = DELAY_UNIFORM;
+        defaults.delayA = atoll(optarg);
+        break;
+      case 'D':
+        parseDelay(optarg, defaults);
         break;
       case 'l':
-        lossProbability = atof(optarg);
+        defaults.lossProbability = atof(optarg);
+        break;
+      case 'u':
+        defaults.dupProbability = atof(optarg);
+        break;
+      case 'o':
+        defaults.reorderProbability = atof(optarg);
+        break;
+      case 'O':
+        defaults.reorderMicros = atoll(optarg);
+        break;
+      case 'b':
+        defaults.bytesPerSecond = atoll(optarg);
+        break;
+      case 'L':
+        overrides.push_back(optarg);
+        break;
+      case 's':
+        seed = strtoull(optarg, NULL, 10);
         break;
       case 'v':
         verbose = true;
         break;
       default:
-        fprintf(stderr, "Syntax: %s [-v] [-d maxDelayMicroseconds] [-l lossProbability] serverListFile\n", argv[0]);
+        fprintf(stderr, "Syntax: %s [-v] [-d maxDelayMicroseconds | -D delayDistribution] [-l lossProbability] [-u duplicateProbability]\n"
+                        "          [-o reorderProbability] [-O reorderMicroseconds] [-b bytesPerSecond] [-L SRC-DST:key=value,...] [-s seed] serverListFile\n", argv[0]);
         exit(1);
     }
   }
@@ -111,6 +301,14 @@ int main(int argc, char *argv[])
     return 1;
   }
 
+  /* A reordered packet waits out about two worst-case delays unless -O says otherwise */
+
+  if (defaults.reorderMicros < 0)
+    defaults.reorderMicros = (defaults.delayKind == DELAY_UNIFORM) ? (long long)(2 * defaults.delayA) : (long long)(2 * (defaults.delayA + 3 * defaults.delayB));
+
+  rng.seed(seed);
+  warning("Random seed %llu (-s %llu reproduces this run)", seed, seed);
+
   /* Read the server list */
 
   FILE *infile = fopen(argv[optind], "r");
@@ -141,8 +339,18 @@ int main(int argc, char *argv[])
   fclose(infile);
   logVerbose("%d server(s) read from '%s'", numServers, argv[optind]);
 
+  for (int i=0; i<numServers; i++)
+    for (int j=0; j<numServers; j++)
+      links[i][j] = defaults;
+  for (size_t i=0; i<overrides.size(); i++)
+    parseLinkOverride(overrides[i]);
+
   /* Open server sockets */
 
+  int epfd = epoll_create1(0);
+  if (epfd < 0)
+    panic("Cannot create epoll instance (%s)", strerror(errno));
+
   for (int i=0; i<numServers; i++) {
     server[i].proxySocket = socket(AF_INET, SOCK_DGRAM, 0);
     if (server[i].proxySocket<0)
@@ -154,68 +362,92 @@ int main(int argc, char *argv[])
     serverAddress.sin_family = AF_INET;
     serverAddress.sin_addr.s_addr = server[i].ip;
     serverAddress.sin_port = htons(server[i].port);
-    if (bind(server[i].proxySocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0) 
+    if (bind(server[i].proxySocket, (struct sockaddr*)&serverAddress, sizeof(serverAddress)) < 0)
       panic("Cannot bind to %s (%s)", paddr(server[i].ip, server[i].port, addrbuf), strerror(errno));
     logVerbose("Listening on %s", paddr(server[i].ip, server[i].port, addrbuf));
 
     int yes = 1;
     if (setsockopt(server[i].proxySocket, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) < 0)
       panic("Cannot set SO_REUSEADDR option on server socket (%s)", strerror(errno));
+    fcntl(server[i].proxySocket, F_SETFL, fcntl(server[i].proxySocket, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, server[i].proxySocket, &ev) < 0)
+      panic("epoll_ctl() failed (%s)", strerror(errno));
   }
 
+  /* epoll_wait() only sleeps in milliseconds, so the next transmit time is armed on a timerfd instead */
+
+  int timerfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (timerfd < 0)
+    panic("Cannot create timerfd (%s)", strerror(errno));
+  struct epoll_event tev;
+  tev.events = EPOLLIN;
+  tev.data.u32 = MAX_SERVERS;
+  if (epoll_ctl(epfd, EPOLL_CTL_ADD, timerfd, &tev) < 0)
+    panic("epoll_ctl() failed (%s)", strerror(errno));
+
+  /* The log is written once per loop iteration instead of once per line */
+
+  static char logbuf[1 << 16];
+  setvbuf(stderr, logbuf, _IOFBF, sizeof(logbuf));
+
   /* Main loop */
 
   char addrbuf1[200], addrbuf2[200];
+  static char databuf[MAX_MSG_LEN+1];
+  static char buffer[MAX_MSG_LEN+1];
+  struct epoll_event events[MAX_SERVERS+1];
   while (true) {
 
-    fd_set rdset;
-    FD_ZERO(&rdset);
-    int maxFD = 0;
-    for (int i=0; i<numServers; i++) {
-      FD_SET(server[i].proxySocket, &rdset);
-      if (server[i].proxySocket > maxFD)
-        maxFD = server[i].proxySocket;
-    }
-
-    long long earliestDelivery = currentTimeMicros() + 1000000;
-    for (int i=0; i<queueLength; i++)
-      if (holdbackQueue[i].xmitTime < earliestDelivery)
-        earliestDelivery = holdbackQueue[i].xmitTime;
-
-    long long maxWaitMicros = earliestDelivery - currentTimeMicros();
+    long long now = currentTimeMicros();
+    long long earliestDelivery = holdbackQueue.empty() ? now + 1000000 : holdbackQueue.top().xmitTime;
+    long long maxWaitMicros = earliestDelivery - now;
     if (maxWaitMicros < 1)
       maxWaitMicros = 1;
 
-    struct timeval tv;
-    tv.tv_sec = maxWaitMicros / 1000000ULL;
-    tv.tv_usec = maxWaitMicros % 1000000ULL;
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = maxWaitMicros / 1000000LL;
+    its.it_value.tv_nsec = (maxWaitMicros % 1000000LL) * 1000;
+    timerfd_settime(timerfd, 0, &its, NULL);
 
     log("Sleep %lld micros", maxWaitMicros);
+    fflush(stderr);
 
-    int ret = select(maxFD+1, &rdset, NULL, NULL, &tv);
-    if (ret<0)
-      panic("select() failed (%s)", strerror(errno));
+    int ret = epoll_wait(epfd, events, MAX_SERVERS+1, -1);
+    if ((ret<0) && (errno != EINTR))
+      panic("epoll_wait() failed (%s)", strerror(errno));
 
-    long long now = currentTimeMicros();
-    for (int i=0; i<queueLength; ) {
-      if (holdbackQueue[i].xmitTime <= now) {
-        deliverQueuedMessage(i);
-        holdbackQueue[i] = holdbackQueue[--queueLength];
-      } else {
-        i++;
-      }
+    now = currentTimeMicros();
+    while (!holdbackQueue.empty() && (holdbackQueue.top().xmitTime <= now)) {
+      deliverQueuedMessage(holdbackQueue.top());
+      holdbackQueue.pop();
     }
 
-    /* Receive a new message */
+    /* Receive new messages */
 
-    for (int i=0; i<numServers; i++) {
-      if (FD_ISSET(server[i].proxySocket, &rdset)) {       // server[i].bindIP,server[i].bindPort is the 'real' destination of this packet
+    for (int e=0; e<ret; e++) {
+      int i = events[e].data.u32;
+      if (i == MAX_SERVERS) {
+        unsigned long long expirations;
+        if (read(timerfd, &expirations, sizeof(expirations)) < 0) {
+          /* nothing to do, the queue was drained above */
+        }
+        continue;
+      }
+
+      while (true) {       // server[i].bindIP,server[i].bindPort is the 'real' destination of this packet
         struct sockaddr_in sender;
         socklen_t senderLength = sizeof(sender);
-        char buffer[65535];
-        int len = recvfrom(server[i].proxySocket, &buffer, sizeof(buffer), 0, (struct sockaddr*)&sender, &senderLength);
-        if (len < 0)
+        int len = recvfrom(server[i].proxySocket, buffer, MAX_MSG_LEN, 0, (struct sockaddr*)&sender, &senderLength);
+        if (len < 0) {
+          if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
           panic("Cannot recvfrom (%s)", strerror(errno));
+        }
 
         buffer[len] = 0;
 
@@ -223,23 +455,21 @@ int main(int argc, char *argv[])
         if (senderIdx < 0)
           panic("Received a packet from %s, but this isn't an actual bind port", paddr(sender.sin_addr.s_addr, ntohs(sender.sin_port), addrbuf1));
 
-        log("RECV %s->%s '%s'", paddr(sender.sin_addr.s_addr, ntohs(sender.sin_port), addrbuf1), paddr(server[i].ip, server[i].port, addrbuf2), buffer);
+        log("RECV %s->%s '%s'", paddr(sender.sin_addr.s_addr, ntohs(sender.sin_port), addrbuf1), paddr(server[i].ip, server[i].port, addrbuf2), pbuf(buffer, len, databuf));
 
-        if (queueLength >= MAX_QUEUE_LEN)
-          panic("Too many queued messages!");
-
-        bool isLost = (rand()%1000)<(int)(lossProbability * 1000);
-        if (!isLost) {
-          holdbackQueue[queueLength].srcServerIdx = senderIdx;
-          holdbackQueue[queueLength].dstServerIdx = i;
-          holdbackQueue[queueLength].xmitTime = currentTimeMicros() + (rand() % maxDelayMicros);
-          strncpy(holdbackQueue[queueLength].buffer, buffer, sizeof(holdbackQueue[queueLength].buffer)-1);
-          queueLength ++;
+        LinkModel &model = links[senderIdx][i];
+        if (uniform01() < model.lossProbability) {
+          logVerbose("Dropping packet from server %d to server %d", senderIdx+1, i+1);
+          continue;
+        }
+        queuePacket(senderIdx, i, buffer, len);
+        if (uniform01() < model.dupProbability) {
+          logVerbose("Duplicating packet from server %d to server %d", senderIdx+1, i+1);
+          queuePacket(senderIdx, i, buffer, len);
         }
-
       }
     }
   }
 
   return 0;
-}  
\ No newline at end of file
+}
@@ -3,43 +3,76 @@
 #include <assert.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <time.h>
+#include <algorithm>
+#include <vector>
 
 #define panic(a...) do { fprintf(stderr, a); fprintf(stderr, "\n"); exit(1); } while (0)
 #define logVerbose(a...) do { if (verbose) { struct timeval tv; gettimeofday(&tv, NULL); printf("TST %d.%03d ", (int)tv.tv_sec, (int)(tv.tv_usec/1000)); printf(a); printf("\n"); } } while(0)
-#define warning(a...) do { fprintf(stderr, "WARNING: "); fprintf(stderr, a); fprintf(stderr, "\n"); } while (0)
+#define warning(a...) do { if (numWarnings++ < MAX_WARNINGS) { fprintf(stderr, "WARNING: "); fprintf(stderr, a); fprintf(stderr, "\n"); } else if (numWarnings == MAX_WARNINGS+1) fprintf(stderr, "WARNING: further warnings suppressed\n"); } while (0)
 
 #define ORDER_UNORDERED 0
 #define ORDER_FIFO 1
 #define ORDER_TOTAL 2
+#define ORDER_CAUSAL 3
 
 #define MAX_SERVERS 10
-#define MAX_CLIENTS 250
 #define MAX_MSG_LEN 50
-#define MAX_MESSAGES 10000
-#define MAX_GROUPS 10
+#define MAX_WARNINGS 1000
+#define MAX_EVENTS 1024
 
 struct {
   in_addr_t ip;
   int port;
 } server[MAX_SERVERS];
 
-struct {
+/* Ordering is checked incrementally on every receipt. Each client keeps, per member of its group,
+   the sender sequence number of the last message it got from that member; that is enough for FIFO,
+   and for causal order once every message records what its sender had received before sending it. */
+
+struct Client {
   int sock;
   int serverIdx;
   int groupID;
+  int groupRank;               // index among the members of the group
   int nextRecvSeq;
-} client[MAX_CLIENTS];
-
-struct {
+  int numSent;
+  std::vector<int> lastFromSender;  // per group rank, 0 = nothing yet
+  std::vector<int> changed;         // ranks whose entry moved since this client last sent (causal only)
+  std::vector<char> dirty;
+};
+
+struct Dependency {
+  int rank;
+  int senderSeq;
+};
+
+struct Message {
   int senderIdx;
   char text[MAX_MSG_LEN+1];
   int groupID;
-  int recvSeq[MAX_CLIENTS];
-} message[MAX_MESSAGES];
+  int senderSeq;     // 1 for the sender's first message, and so on
+  int recvCount;
+  long long sentMicros;
+  int depStart;      // slice of dependencies[], causal only
+  int depCount;
+};
+
+struct Group {
+  std::vector<int> members;     // client indexes
+  std::vector<int> totalOrder;  // message indexes in the order the first client received them
+};
+
+std::vector<Client> client;
+std::vector<Message> message;
+std::vector<Group> group;
+std::vector<Dependency> dependencies;
 
 bool verbose = false;
 int ordering = ORDER_UNORDERED;
@@ -49,7 +82,19 @@ int numGroups = 1;
 int numMessages = 0;
 int maxMessages = 10;
 int finalDelaySeconds = 5;
+int numWarnings = 0;
 long long xmitIntervalMicros = 100000;
+bool benchmark = false;
+
+/* Benchmark mode: each message carries the time it was scheduled to be sent. Latency is measured
+   from that time, not from when sendto() actually ran, so a tester that falls behind its open-loop
+   schedule (coordinated omission) still charges the delay to the servers. */
+
+std::vector<long long> latencyCorrected;
+std::vector<long long> latencyRaw;
+long long firstXmit = 0, lastXmit = 0, lastRecv = 0;
+
+const char *orderingName[] = {"no particular", "FIFO", "total", "causal"};
 
 void readServerList(const char *filename)
 {
@@ -99,67 +144,218 @@ long long currentTimeMicros()
   return (tv.tv_sec*1000000LL + tv.tv_usec);
 }
 
+/* 10k clients need 10k sockets, so lift the soft descriptor limit as far as the hard limit allows */
+
+void raiseFileLimit(int needed)
+{
+  struct rlimit rl;
+  if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+    panic("getrlimit() failed (%s)", strerror(errno));
+  if (rl.rlim_cur >= (rlim_t)needed)
+    return;
+  rl.rlim_cur = std::min((rlim_t)needed, rl.rlim_max);
+  if ((setrlimit(RLIMIT_NOFILE, &rl) < 0) || (rl.rlim_cur < (rlim_t)needed))
+    panic("Cannot open %d sockets, the descriptor limit is %d", needed, (int)rl.rlim_cur);
+}
+
 bool checkMessageOrdering(int msgIdx, int clientIdx)
 {
   assert((0<=msgIdx) && (msgIdx<numMessages));
   assert((0<=clientIdx) && (clientIdx<numClients));
-  assert(message[msgIdx].recvSeq[clientIdx] >= 1);
-
-  // For unordered delivery, we don't have to check anything
 
-  if (ordering == ORDER_UNORDERED)
-  	return true;
+  Message &m = message[msgIdx];
+  Client &c = client[clientIdx];
+  int rank = client[m.senderIdx].groupRank;
+  bool ok = true;
 
-  // For total ordering, we need to check whether all clients receive the messages in the same order
+  // For total ordering, the n-th message of every client in a group has to be the same one; the
+  // first client to get that far decides which one it is
 
   if (ordering == ORDER_TOTAL) {
-  	for (int i=0; i<numClients; i++) {
-        if ((client[i].groupID==client[clientIdx].groupID) && (message[msgIdx].recvSeq[i] != -1) && (message[msgIdx].recvSeq[i] != message[msgIdx].recvSeq[clientIdx])) { 
-      	warning("Message M%03d was received as #%d by client C%02d, but as #%d by client C%02d",
-      	  1+msgIdx, 1+message[msgIdx].recvSeq[i], 1+i, 1+message[msgIdx].recvSeq[clientIdx], 1+clientIdx
-      	);
-      	return false;
-      }
-  	}
+    std::vector<int> &order = group[m.groupID].totalOrder;
+    int pos = c.nextRecvSeq - 1;
+    if (pos == (int)order.size()) {
+      order.push_back(msgIdx);
+    } else if (order[pos] != msgIdx) {
+      warning("Client C%02d received message M%03d as #%d, but another client received M%03d as #%d",
+        1+clientIdx, 1+msgIdx, 1+pos, 1+order[pos], 1+pos
+      );
+      ok = false;
+    }
   }
 
-  // For FIFO ordering, we need to check whether the client has already received a later message by the same sender
+  // For causal ordering, everything the sender had received before sending has to be here already
 
-  if (ordering == ORDER_FIFO) {
-  	for (int i=msgIdx+1; i<numMessages; i++) {
-  		if ((message[i].senderIdx == message[msgIdx].senderIdx) && (message[i].recvSeq[clientIdx] >= 0)) {
-        warning("Client C%02d sent message M%03d before message M%03d, but client C%02d received them in the reverse order",
-        	message[i].senderIdx+1, msgIdx+1, i+1, clientIdx+1
+  if (ordering == ORDER_CAUSAL) {
+    for (int i=0; i<m.depCount; i++) {
+      Dependency &d = dependencies[m.depStart + i];
+      if (c.lastFromSender[d.rank] < d.senderSeq) {
+        warning("Client C%02d received message M%03d before message #%d of client C%02d, which its sender had already seen",
+          1+clientIdx, 1+msgIdx, d.senderSeq, 1+group[m.groupID].members[d.rank]
         );
-        return false;
-  		}
-  	}
+        ok = false;
+        break;
+      }
+    }
   }
 
-  return true;
+  // For FIFO (and causal) ordering, messages from one sender have to arrive in the order they were sent
+
+  if (m.senderSeq <= c.lastFromSender[rank]) {
+    if ((ordering == ORDER_FIFO) || (ordering == ORDER_CAUSAL)) {
+      warning("Client C%02d sent message M%03d as its #%d, but client C%02d received it after the sender's #%d",
+        m.senderIdx+1, msgIdx+1, m.senderSeq, clientIdx+1, c.lastFromSender[rank]
+      );
+      ok = false;
+    }
+    return ok;
+  }
+
+  c.lastFromSender[rank] = m.senderSeq;
+  if ((ordering == ORDER_CAUSAL) && !c.dirty[rank]) {
+    c.dirty[rank] = 1;
+    c.changed.push_back(rank);
+  }
+  return ok;
 }
 
 int countMissingMessages()
 {
 	int numMissing = 0;
 	for (int i=0; i<numMessages; i++) {
-		for (int j=0; j<numClients; j++) {
-			if ((client[j].groupID == message[i].groupID) && (message[i].recvSeq[j] < 0)) {
-				warning("Message M%03d was not delivered to client C%02d", i+1, j+1);
-				numMissing ++;
-			}
+		int groupSize = group[message[i].groupID].members.size();
+		if (message[i].recvCount < groupSize) {
+			warning("Message M%03d was delivered to only %d of the %d clients in group G%d", i+1, message[i].recvCount, groupSize, message[i].groupID);
+			numMissing += groupSize - message[i].recvCount;
 		}
 	}
 
 	return numMissing;
 }
 
+long long percentile(std::vector<long long> &sorted, double p)
+{
+  size_t idx = (size_t)(p*sorted.size());
+  if (idx >= sorted.size())
+    idx = sorted.size()-1;
+  return sorted[idx];
+}
+
+void printBenchmarkReport()
+{
+  int numLatencies = latencyCorrected.size();
+  if (!numLatencies) {
+    fprintf(stderr, "Benchmark: no messages were delivered\n");
+    return;
+  }
+
+  std::sort(latencyCorrected.begin(), latencyCorrected.end());
+  std::sort(latencyRaw.begin(), latencyRaw.end());
+
+  double sendSeconds = (lastXmit > firstXmit) ? (lastXmit-firstXmit)/1000000.0 : 1e-6;
+  double recvSeconds = (lastRecv > firstXmit) ? (lastRecv-firstXmit)/1000000.0 : 1e-6;
+  fprintf(stderr, "Benchmark: %d messages sent at %.0f msgs/sec (target %.0f), %d deliveries (fan-out %.1f) at %.0f deliveries/sec\n",
+    numMessages, numMessages/sendSeconds, 1000000.0/xmitIntervalMicros, numLatencies, (double)numLatencies/numMessages, numLatencies/recvSeconds);
+  fprintf(stderr, "Latency (us, from scheduled send): p50 %lld  p99 %lld  p999 %lld  max %lld\n",
+    percentile(latencyCorrected, 0.5), percentile(latencyCorrected, 0.99),
+    percentile(latencyCorrected, 0.999), latencyCorrected[numLatencies-1]);
+  fprintf(stderr, "Latency (us, from actual send):    p50 %lld  p99 %lld  p999 %lld  max %lld\n",
+    percentile(latencyRaw, 0.5), percentile(latencyRaw, 0.99),
+    percentile(latencyRaw, 0.999), latencyRaw[numLatencies-1]);
+}
+
+void sendNextMessage(long long scheduled)
+{
+  message.push_back(Message());
+  Message &m = message[numMessages];
+  m.senderIdx = rand()%numClients;
+  m.groupID = client[m.senderIdx].groupID;
+  m.recvCount = 0;
+  if (benchmark)
+    sprintf(m.text, "M%d-S%d-G%d-%lld", numMessages+1, m.senderIdx+1, m.groupID, scheduled);
+  else
+    sprintf(m.text, "M%d-S%d-G%d-%06d", numMessages+1, m.senderIdx+1, m.groupID, rand()%100000);
+
+  // Snapshot what the sender has received since its previous message; earlier receipts were
+  // recorded as dependencies of that message already
+
+  Client &sender = client[m.senderIdx];
+  m.senderSeq = ++sender.numSent;
+  m.depStart = dependencies.size();
+  m.depCount = sender.changed.size();
+  for (size_t i=0; i<sender.changed.size(); i++) {
+    Dependency d = {sender.changed[i], sender.lastFromSender[sender.changed[i]]};
+    dependencies.push_back(d);
+    sender.dirty[sender.changed[i]] = 0;
+  }
+  sender.changed.clear();
+
+  logVerbose("Client C%02d sends message M%03d (%s) to group G%d", m.senderIdx+1, numMessages+1, m.text, m.groupID);
+  sendToServer(m.senderIdx, sender.serverIdx, m.text);
+  m.sentMicros = currentTimeMicros();
+  if (!numMessages)
+    firstXmit = scheduled;
+  lastXmit = m.sentMicros;
+  numMessages ++;
+}
+
+int receiveMessage(int clientIdx, char *buffer)
+{
+  if (buffer[0] != '<') {
+    warning("Client C%02d received a message that did not contain a sender ID <...> (%s)", 1+clientIdx, buffer);
+    return 0;
+  }
+
+  char *mptr = &buffer[1];
+  while (*mptr && (*mptr != '>'))
+    mptr++;
+  if (*mptr == 0) {
+    warning("Client C%02d received a message that contained an opening '<', but no closing '>' (%s)", 1+clientIdx, buffer);
+    return 0;
+  }
+  mptr ++;
+  if (*mptr == ' ')
+    mptr ++;
+
+  if (mptr[0] != 'M') {
+    warning("Client C%02d received a message that was never sent (%s)", 1+clientIdx, mptr);
+    return 0;
+  }
+  int msgID = atoi(&mptr[1])-1;
+  if ((msgID < 0) || (msgID >= numMessages)) {
+    warning("Client C%02d received a message with an invalid message ID (%s)", 1+clientIdx, mptr);
+    return 0;
+  }
+  if (strcmp(mptr, message[msgID].text)) {
+    warning("Client C%02d received a corrupted message (%s); no such message has been sent", 1+clientIdx, mptr);
+    return 0;
+  }
+  if (client[clientIdx].groupID != message[msgID].groupID) {
+    warning("Client C%02d in group G%d received message M%03d, which was sent to group G%d", 1+clientIdx, client[clientIdx].groupID, 1+msgID, message[msgID].groupID);
+    return 1;
+  }
+
+  logVerbose("Client C%02d receives message M%03d (%s) as seq #%d", 1+clientIdx, 1+msgID, mptr, client[clientIdx].nextRecvSeq);
+  int errors = checkMessageOrdering(msgID, clientIdx) ? 0 : 1;
+  client[clientIdx].nextRecvSeq ++;
+  message[msgID].recvCount ++;
+
+  if (benchmark) {
+    long long now = currentTimeMicros();
+    long long scheduled = atoll(strrchr(mptr, '-')+1);
+    latencyCorrected.push_back(now - scheduled);
+    latencyRaw.push_back(now - message[msgID].sentMicros);
+    lastRecv = now;
+  }
+  return errors;
+}
+
 int main(int argc, char *argv[])
 {
   /* Parse arguments */
 
   int c;
-  while ((c = getopt(argc, argv, "o:c:g:m:i:f:v")) != -1) {
+  while ((c = getopt(argc, argv, "o:c:g:m:i:f:r:bv")) != -1) {
     switch (c) {
       case 'o':
         if (!strcmp(optarg, "unordered"))
@@ -168,8 +364,10 @@ int main(int argc, char *argv[])
           ordering = ORDER_FIFO;
         else if (!strcmp(optarg, "total"))
           ordering = ORDER_TOTAL;
+        else if (!strcmp(optarg, "causal"))
+          ordering = ORDER_CAUSAL;
         else
-          panic("Unknown ordering: '%s' (supported: unordered, fifo, total)", optarg);
+          panic("Unknown ordering: '%s' (supported: unordered, fifo, total, causal)", optarg);
         break;
       case 'c':
         numClients = atoi(optarg);
@@ -186,11 +384,22 @@ int main(int argc, char *argv[])
       case 'm':
         maxMessages = atoi(optarg);
         break;
+      case 'r':
+        if (atoi(optarg) < 1)
+          panic("Invalid rate: '%s' messages per second", optarg);
+        xmitIntervalMicros = 1000000LL/atoi(optarg);
+        if (xmitIntervalMicros < 1)
+          xmitIntervalMicros = 1;
+        benchmark = true;
+        break;
+      case 'b':
+        benchmark = true;
+        break;
       case 'v':
         verbose = true;
         break;
       default:
-        fprintf(stderr, "Syntax: %s [-v] [-d maxDelayMicroseconds] [-l lossProbability] serverListFile\n", argv[0]);
+        fprintf(stderr, "Syntax: %s [-v] [-b] [-o ordering] [-c clients] [-g groups] [-m messages] [-i intervalMs | -r msgsPerSec] [-f finalDelaySeconds] serverListFile\n", argv[0]);
         exit(1);
     }
   }
@@ -199,24 +408,46 @@ int main(int argc, char *argv[])
     fprintf(stderr, "Error: Name of the server list file is missing!\n");
     return 1;
   }
+  if ((numClients < 1) || (numGroups < 1) || (maxMessages < 0) || (xmitIntervalMicros < 1))
+    panic("Invalid number of clients, groups, messages or send interval");
 
   /* Initialize the random number generator, and read the server list from the file */
 
   srand(time(0));
   readServerList(argv[optind]);
+  raiseFileLimit(numClients + 64);
+
+  message.reserve(maxMessages);
+  if (benchmark) {
+    latencyCorrected.reserve(maxMessages);
+    latencyRaw.reserve(maxMessages);
+  }
 
-  fprintf(stderr, "Sending %d messages from %d clients to %d groups in %dms intervals, checking for %s ordering\n",
-  	maxMessages, numClients, numGroups, (int)(xmitIntervalMicros/1000LL), ((ordering==ORDER_UNORDERED) ? "no particular" : ((ordering==ORDER_FIFO) ? "FIFO" : "total")));
+  if (benchmark)
+    fprintf(stderr, "Sending %d messages from %d clients to %d groups at %lld msgs/sec, checking for %s ordering\n",
+      maxMessages, numClients, numGroups, 1000000LL/xmitIntervalMicros, orderingName[ordering]);
+  else
+    fprintf(stderr, "Sending %d messages from %d clients to %d groups in %dms intervals, checking for %s ordering\n",
+  	  maxMessages, numClients, numGroups, (int)(xmitIntervalMicros/1000LL), orderingName[ordering]);
 
   /* Open client sockets and make each client /join one of the groups */
 
+  int epfd = epoll_create1(0);
+  if (epfd < 0)
+    panic("Cannot create epoll instance (%s)", strerror(errno));
+
+  client.resize(numClients);
+  group.resize(numGroups+1);
   for (int i=0; i<numClients; i++) {
     client[i].sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (client[i].sock<0)
       panic("Cannot open client socket (%s)", strerror(errno));
     client[i].serverIdx = rand()%numServers;
     client[i].groupID = 1+rand()%numGroups;
+    client[i].groupRank = group[client[i].groupID].members.size();
+    group[client[i].groupID].members.push_back(i);
     client[i].nextRecvSeq = 1;
+    client[i].numSent = 0;
 
     char joinCommand[100];
     sprintf(joinCommand, "/join %d", client[i].groupID);
@@ -229,125 +460,77 @@ int main(int argc, char *argv[])
     int len = recvfrom(client[i].sock, &buffer, sizeof(buffer), 0, (struct sockaddr*)&sender, &senderLength);
     if (len < 0)
       panic("Cannot recvfrom (%s)", strerror(errno));
+
+    fcntl(client[i].sock, F_SETFL, fcntl(client[i].sock, F_GETFL) | O_NONBLOCK);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.u32 = i;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, client[i].sock, &ev) < 0)
+      panic("epoll_ctl() failed (%s)", strerror(errno));
+  }
+
+  for (int i=0; i<numClients; i++) {
+    int groupSize = group[client[i].groupID].members.size();
+    client[i].lastFromSender.assign(groupSize, 0);
+    if (ordering == ORDER_CAUSAL)
+      client[i].dirty.assign(groupSize, 0);
   }
 
   /* Main loop */
 
   long long nextXmit = currentTimeMicros();
   int numErrors = 0;
-  int maxWaitCycles = finalDelaySeconds * 1000000/xmitIntervalMicros;
-  int numWaitCycles = 0;
+  long long maxWaitCycles = finalDelaySeconds * 1000000LL/xmitIntervalMicros;
+  long long numWaitCycles = 0;
+  struct epoll_event events[MAX_EVENTS];
   while ((numMessages<maxMessages) || (numWaitCycles < maxWaitCycles)) {
-    fd_set rdset;
-    FD_ZERO(&rdset);
-    int maxFD = 0;
-    for (int i=0; i<numClients; i++) {
-      FD_SET(client[i].sock, &rdset);
-      if (client[i].sock > maxFD)
-        maxFD = client[i].sock;
-    }
-
-    /* Compute a timeout, so we can wake up when the next message needs to be sent */
 
-    long long maxWaitMicros = nextXmit - currentTimeMicros();
-    if (maxWaitMicros < 1)
-      maxWaitMicros = 1;
+    /* Compute a timeout, so we can wake up when the next message needs to be sent; epoll_pwait2()
+       takes it in nanoseconds, so intervals under a millisecond sleep too instead of polling */
 
-    struct timeval tv;
-    tv.tv_sec = maxWaitMicros / 1000000ULL;
-    tv.tv_usec = maxWaitMicros % 1000000ULL;
+    long long maxWaitMicros = std::max(0LL, nextXmit - currentTimeMicros());
+    struct timespec timeout = { (time_t)(maxWaitMicros / 1000000), (long)(maxWaitMicros % 1000000) * 1000 };
 
-    /* Wait for an incoming packet and/or the timeout */
+    /* Wait for an incoming packet and/or the timeout; a kernel before 5.11 only has epoll_wait(),
+       which gets the wait rounded up to whole milliseconds */
 
-    int ret = select(maxFD+1, &rdset, NULL, NULL, &tv);
-    if (ret<0)
-      panic("select() failed (%s)", strerror(errno));
+    int ret = epoll_pwait2(epfd, events, MAX_EVENTS, &timeout, NULL);
+    if ((ret<0) && (errno == ENOSYS))
+      ret = epoll_wait(epfd, events, MAX_EVENTS, (int)((maxWaitMicros + 999) / 1000));
+    if ((ret<0) && (errno != EINTR))
+      panic("epoll_wait() failed (%s)", strerror(errno));
 
     /* If it is time to send another message, do that. Once all the messages have been sent,
        we still wait a little bit, so that any 'stragglers' (delayed messages) can be received */
 
     while (nextXmit <= currentTimeMicros()) {
       if (numMessages < maxMessages) {
-  	    message[numMessages].senderIdx = rand()%numClients;
-      	message[numMessages].groupID = client[message[numMessages].senderIdx].groupID;
-      	sprintf(message[numMessages].text, "M%d-S%d-G%d-%06d", 
-      	  numMessages+1, 
-      	  message[numMessages].senderIdx+1,
-      	  message[numMessages].groupID, 
-      	  rand()%100000
-        );
-        for (int i=0; i<MAX_CLIENTS; i++)
-          message[numMessages].recvSeq[i] = -1;
-        logVerbose("Client C%02d sends message M%03d (%s) to group G%d", 
-        	message[numMessages].senderIdx+1,
-        	numMessages+1,
-        	message[numMessages].text,
-          message[numMessages].groupID
-        );
-        sendToServer(
-          message[numMessages].senderIdx, 
-          client[message[numMessages].senderIdx].serverIdx, 
-          message[numMessages].text
-        );
-        numMessages ++;
+        sendNextMessage(nextXmit);
       } else {
       	numWaitCycles ++;
       	if (numWaitCycles == 1)
       		logVerbose("Waiting %d seconds for stragglers...", finalDelaySeconds);
       }
-      nextXmit += xmitIntervalMicros;	
+      nextXmit += xmitIntervalMicros;
     }
 
-    /* Receive new messages, and do a couple of sanity checks */
+    /* Receive new messages, draining each ready socket, and do a couple of sanity checks */
 
-    for (int i=0; i<numClients; i++) {
-      if (FD_ISSET(client[i].sock, &rdset)) {
+    for (int e=0; e<ret; e++) {
+      int i = events[e].data.u32;
+      while (true) {
         struct sockaddr_in sender;
         socklen_t senderLength = sizeof(sender);
         char buffer[65535];
-        int len = recvfrom(client[i].sock, &buffer, sizeof(buffer), 0, (struct sockaddr*)&sender, &senderLength);
-        if (len < 0)
+        int len = recvfrom(client[i].sock, &buffer, sizeof(buffer)-1, 0, (struct sockaddr*)&sender, &senderLength);
+        if (len < 0) {
+          if ((errno == EAGAIN) || (errno == EWOULDBLOCK))
+            break;
           panic("Error during recvfrom (%s)", strerror(errno));
+        }
 
         buffer[len] = 0;
-
-        if (buffer[0] == '<') {
-          char *mptr = &buffer[1];
-          while (*mptr && (*mptr != '>'))
-          	mptr++;
-
-          if (*mptr != 0) {
-            mptr ++;
-            if (*mptr == ' ')
-            	mptr ++;
-
-            if (mptr[0] == 'M') {
-              char buf2[strlen(mptr)+1];
-              strcpy(buf2, &mptr[1]);
-              strtok(buf2, "-");
-              int msgID = atoi(buf2)-1;
-              if ((0<=msgID) && (msgID < numMessages)) {
-                if (!strcmp(mptr, message[msgID].text)) {
-                	logVerbose("Client C%02d receives message M%03d (%s) as seq #%d", 1+i, 1+msgID, mptr, client[i].nextRecvSeq);
-                  message[msgID].recvSeq[i] = client[i].nextRecvSeq ++;
-      
-                  if (!checkMessageOrdering(msgID, i))
-                  	numErrors ++;
-                } else {
-                	warning("Client C%02d received a corrupted message (%s); no such message has been sent", 1+i, mptr);
-                }
-              } else {
-                warning("Client C%02d received a message with an invalid message ID (%s)", 1+i, mptr);
-              }
-            } else {
-              warning("Client C%02d received a message that was never sent (%s)", 1+i, mptr);
-            }
-          } else {
-            warning("Client C%02d received a message that contained an opening '<', but no closing '>' (%s)", 1+i, buffer);
-          }
-        } else {
-          warning("Client C%02d received a message that did not contain a sender ID <...> (%s)", 1+i, buffer);
-        }
+        numErrors += receiveMessage(i, buffer);
       }
     }
   }
@@ -356,12 +539,14 @@ int main(int argc, char *argv[])
      all the messages have been delivered to all the clients */
 
   numErrors += countMissingMessages();
- 
+
   if (!numErrors)
   	fprintf(stderr, "Ordering OK\n");
   else
   	fprintf(stderr, "%d ordering error(s) found\n", numErrors);
 
+  if (benchmark)
+    printBenchmarkReport();
 
    /* Quit all clients */
 
@@ -372,4 +557,4 @@ int main(int argc, char *argv[])
   }
 
   return 0;
-}
\ No newline at end of file
+}